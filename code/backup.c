@@ -2,6 +2,8 @@
 //SPDX-FileCopyrightText: © 2024 Junsu Lee <junsulee119@gmail.com>
 //SPDX-License-Identifier: GNU Affero General Public License v3.0
 
+#define _GNU_SOURCE     // For copy_file_range() and other Linux extensions
+
 #include <stdio.h>      // For standard I/O functions
 #include <stdlib.h>     // For general purpose functions like exit()
 #include <unistd.h>     // For getopt() and other Unix standard functions
@@ -13,6 +15,23 @@
 #include <errno.h>      // For error reporting
 #include <limits.h>     // For PATH_MAX definition
 #include <pwd.h>        // For getting home directory
+#include <fcntl.h>      // For open() flags on raw file descriptors
+#include <sys/ioctl.h>  // For ioctl()
+#include <linux/fs.h>   // For the FICLONE reflink ioctl
+#include <linux/fiemap.h> // For finding where a file's data is on disk
+#include <sys/mman.h>   // For mapping the io_uring rings
+#include <sys/syscall.h> // For the raw io_uring system calls
+#include <sys/uio.h>    // For struct iovec
+#include <sys/vfs.h>    // For statfs() and filesystem type magic numbers
+#include <sys/sendfile.h> // For the sendfile() copy strategy
+#include <sys/sysmacros.h> // For major() and minor() of device numbers
+#include <linux/io_uring.h> // For io_uring structures and constants
+#include <pthread.h>    // For the reader thread of pipelined copies
+#include <stdint.h>     // For SIZE_MAX
+#include <signal.h>     // For ignoring SIGPIPE while streaming
+#include <sys/socket.h> // For streaming to a Unix socket
+#include <sys/un.h>     // For struct sockaddr_un
+#include <sys/resource.h> // For the open file limit
 
 #define DEFAULT_TARGET_DIR "/media/pi/piBackup" // Default directory for backups
 #define CONFIG_FILE_PATH "%s/.config/backup_tool.conf" // Path for configuration file
@@ -24,16 +43,642 @@
 #define YELLOW "\033[33m"   // For [WARNING]
 #define GRAY "\033[90m" // For [DEBUG] and [INFO]
 
+#define MAX_DEV_CAPS 32 // Number of (source device, target device) pairs remembered per run
+#define URING_CHUNK_SIZE (1024 * 1024) // Default bytes moved by each io_uring read/write pair
+#define MAX_BUFFER_SIZE (1024ULL * 1024 * 1024) // Upper limit for the buffer size options
+#define MAX_PIPELINE_DEPTH 64 // Upper limit for the pipeline_depth option
+#define DIRECT_IO_ALIGN 4096 // Buffer, offset and length alignment used for O_DIRECT
+#define MAX_FILE_JOBS 64 // Upper limit for the file_jobs option
+#define MAX_SMALL_FILE (16 * 1024 * 1024) // Upper limit for the small_file_max option
+#define PROBE_MIN_SIZE (1024 * 1024) // Smallest file worth probing copy strategies with
+#define PROBE_BYTES (8 * 1024 * 1024) // How much of that file each strategy copies while probing
+#define SPLICE_PIPE_SIZE (1024 * 1024) // Pipe capacity asked for by the splice strategy
+#define URING_MAX_DEPTH 256 // Upper limit for the uring_depth option
+#define TAR_BLOCK_SIZE 512 // Unit of headers and data in a tar stream
+#define TAR_RECORD_SIZE (20 * TAR_BLOCK_SIZE) // A tar stream ends on a whole record
+#define STREAM_CHUNK_SIZE (1024 * 1024) // Bytes moved to the stream per system call
+#define WRITE_LATENCY_BUCKETS 24 // Power-of-two microsecond buckets of the write latency histogram (up to ~8 s)
+#define MAX_OPEN_DIRS 64 // Directory descriptors kept open during the traversal
+#define DIRENT_BUFFER_SIZE (1024 * 1024) // Bytes of directory entries fetched per getdents64() call
+#define MAX_SYNC_BATCH_FILES 1024 // Upper limit for the sync_batch_files option (each one holds a descriptor open)
+#define FDS_PER_JOB 8 // Descriptors a worker may hold besides the batch (its files, splice pipe, pinned directories)
+#define FDS_RESERVED 32 // Descriptors kept free for everything else (standard streams, config file, io_uring)
+#define MAX_JOBS 256 // Upper limit for the jobs option
+#define COPY_SHORT 2 // Result of a copy strategy whose source ended before the size it had when opened
+
+// Engines that move file data
+enum copy_engine {
+    ENGINE_SYNC,    // One file at a time with blocking system calls
+    ENGINE_URING,   // Many reads and writes in flight across files with io_uring
+};
+
+static const char *const engine_names[] = { "sync", "uring", NULL };
+
+// Ways of moving a file's data once it isn't cloned, sparse, small or handled
+// by one of the large-file modes, in the order they are tried by default
+enum copy_strategy {
+    STRATEGY_COPY_FILE_RANGE,   // copy_file_range(), entirely in the kernel
+    STRATEGY_SENDFILE,          // sendfile() from the source's page cache
+    STRATEGY_SPLICE,            // splice() through a pipe
+    STRATEGY_MMAP,              // write() from a mapping of the source
+    STRATEGY_READ_WRITE,        // read() and write() through a buffer
+    STRATEGY_COUNT
+};
+
+// Values of the strategy option: "auto", then one name per copy_strategy
+static const char *const strategy_names[] = { "auto", "copy_file_range", "sendfile", "splice", "mmap", "read_write", NULL };
+
+// How file data reaches the sink of the stream option
+enum stream_method {
+    STREAM_SPLICE,      // splice() from the file straight into a pipe
+    STREAM_SENDFILE,    // sendfile() to a socket, device or file
+    STREAM_READ_WRITE,  // pread() into a buffer and write() it out
+};
+
+static const char *const stream_method_names[] = { "splice", "sendfile", "read/write" };
+
+// When the copied data is forced out to the target device
+enum durability_policy {
+    DURABILITY_NONE,    // Never; the kernel writes it back whenever it likes
+    DURABILITY_BATCH,   // fdatasync() finished files in groups as the backup goes
+    DURABILITY_SYNCFS,  // One syncfs() of the target filesystem at the end
+};
+
+static const char *const durability_names[] = { "none", "batch", "syncfs", NULL };
+
+// Order in which the entries of a directory are handled
+enum entry_order {
+    ORDER_AUTO,     // Inode order if the source is on a rotational disk, otherwise as listed
+    ORDER_NONE,     // As the filesystem lists them (hash order on most filesystems)
+    ORDER_INODE,    // By inode number, which follows the on-disk layout on most filesystems
+    ORDER_EXTENT,   // Regular files by the physical address of their first extent (FIEMAP)
+};
+
+static const char *const order_names[] = { "auto", "none", "inode", "extent", NULL };
+
+// When the parallel traversal copies the files it finds
+enum file_schedule {
+    SCHEDULE_DISCOVERY, // As soon as their directory is listed
+    SCHEDULE_LARGEST,   // After the whole tree is listed, largest first
+};
+
+static const char *const schedule_names[] = { "discovery", "largest", NULL };
+
+// Runtime options, set on the command line with "-o key[=value]"
+struct backup_options {
+    int reflink;    // Clone file extents with FICLONE instead of copying when the filesystem allows it
+    int engine;     // Which copy engine to use (enum copy_engine)
+    int uring_depth; // Number of read/write chunk pairs the io_uring engine keeps in flight
+    int prealloc;   // Reserve each destination file's full size with fallocate() before writing
+    unsigned long long buffer_size; // Fixed I/O buffer size, or 0 to pick one per file
+    unsigned long long buffer_min;  // Smallest buffer the per-file policy may pick
+    unsigned long long buffer_max;  // Largest buffer the per-file policy may pick
+    unsigned long long pipeline_threshold; // Overlap reading and writing for cross-device files this large (0 = never)
+    int pipeline_depth; // Number of buffers between the reader and the writer of a pipelined copy
+    unsigned long long direct_threshold; // Bypass the page cache with O_DIRECT for files this large (0 = never)
+    int nocache;    // Drop copied pages from the page cache as the copy moves on
+    unsigned long long cache_window; // How much of a file may stay cached before it is dropped
+    int file_jobs;  // Threads copying ranges of one large file at the same time (1 = off)
+    unsigned long long range_size; // Size of the ranges a large file is split into
+    unsigned long long small_file_max; // Copy files up to this size with one read() and one write()
+    int strategy;   // 0 to probe for the fastest copy strategy, otherwise 1 + the copy_strategy to use first
+    char *stream;   // Write a tar stream here ("-" for standard output) instead of a backup directory, or NULL
+    int zerocopy;   // Move streamed file data with splice()/sendfile() instead of through a buffer
+    int durability; // When copied data is flushed to the target (enum durability_policy)
+    unsigned long long sync_batch_bytes; // Flush a batch once its files hold this much data
+    int sync_batch_files; // Flush a batch once it holds this many files
+    unsigned long long writeback_window; // Start writeback every this many bytes of a file and wait for the previous window (0 = off)
+    int write_latency; // Print the write latency histogram in the report
+    int jobs;       // Threads walking the tree and copying the files they find (0 = one per online CPU)
+    int order;      // Order in which a directory's entries are handled (enum entry_order)
+    int schedule;   // When the parallel traversal copies files (enum file_schedule)
+};
+
+static struct backup_options options = {
+    .reflink = 0,
+    .engine = ENGINE_SYNC,
+    .uring_depth = 16,
+    .prealloc = 1,
+    .buffer_size = 0,
+    .buffer_min = 64 * 1024,
+    .buffer_max = 8 * 1024 * 1024,
+    .pipeline_threshold = 64 * 1024 * 1024,
+    .pipeline_depth = 4,
+    .direct_threshold = 0,
+    .nocache = 0,
+    .cache_window = 16 * 1024 * 1024,
+    .file_jobs = 4,
+    .range_size = 256 * 1024 * 1024,
+    .small_file_max = 16 * 1024,
+    .strategy = 0,
+    .stream = NULL,
+    .zerocopy = 1,
+    .durability = DURABILITY_SYNCFS,
+    .sync_batch_bytes = 256 * 1024 * 1024,
+    .sync_batch_files = 256,
+    .writeback_window = 0,
+    .write_latency = 0,
+    .jobs = 0,
+    .order = ORDER_AUTO,
+    .schedule = SCHEDULE_DISCOVERY,
+};
+
+// Kinds of values an option can take
+enum option_type {
+    OPT_BOOL,   // "key", "key=1" or "key=0" (also yes/no, on/off)
+    OPT_INT,    // "key=N" with N a positive integer
+    OPT_SIZE,   // "key=N" with an optional K, M or G suffix (powers of 1024)
+    OPT_CHOICE, // "key=name" with name one of the option's choices
+    OPT_STRING, // "key=text", stored as a heap copy
+    OPT_PROBE,  // A probe result saved in the config file (see save_probe_results())
+};
+
+// Description of a single "-o" option
+struct option_def {
+    const char *key;        // Name used on the command line
+    enum option_type type;  // How to parse the value
+    void *value;            // Where to store the parsed value
+    const char *const *choices; // Accepted names for OPT_CHOICE, NULL-terminated
+};
+
+static const struct option_def option_defs[] = {
+    { "reflink", OPT_BOOL, &options.reflink, NULL },
+    { "engine", OPT_CHOICE, &options.engine, engine_names },
+    { "uring_depth", OPT_INT, &options.uring_depth, NULL },
+    { "prealloc", OPT_BOOL, &options.prealloc, NULL },
+    { "buffer_size", OPT_SIZE, &options.buffer_size, NULL },
+    { "buffer_min", OPT_SIZE, &options.buffer_min, NULL },
+    { "buffer_max", OPT_SIZE, &options.buffer_max, NULL },
+    { "pipeline_threshold", OPT_SIZE, &options.pipeline_threshold, NULL },
+    { "pipeline_depth", OPT_INT, &options.pipeline_depth, NULL },
+    { "direct_threshold", OPT_SIZE, &options.direct_threshold, NULL },
+    { "nocache", OPT_BOOL, &options.nocache, NULL },
+    { "cache_window", OPT_SIZE, &options.cache_window, NULL },
+    { "file_jobs", OPT_INT, &options.file_jobs, NULL },
+    { "range_size", OPT_SIZE, &options.range_size, NULL },
+    { "small_file_max", OPT_SIZE, &options.small_file_max, NULL },
+    { "strategy", OPT_CHOICE, &options.strategy, strategy_names },
+    { "probe", OPT_PROBE, NULL, NULL },
+    { "stream", OPT_STRING, &options.stream, NULL },
+    { "zerocopy", OPT_BOOL, &options.zerocopy, NULL },
+    { "durability", OPT_CHOICE, &options.durability, durability_names },
+    { "sync_batch_bytes", OPT_SIZE, &options.sync_batch_bytes, NULL },
+    { "sync_batch_files", OPT_INT, &options.sync_batch_files, NULL },
+    { "writeback_window", OPT_SIZE, &options.writeback_window, NULL },
+    { "write_latency", OPT_BOOL, &options.write_latency, NULL },
+    { "jobs", OPT_INT, &options.jobs, NULL },
+    { "order", OPT_CHOICE, &options.order, order_names },
+    { "schedule", OPT_CHOICE, &options.schedule, schedule_names },
+};
+
+// What we learned about copying between a source device and a target device.
+// Probed on the first file of each pair and then reused for the rest of the run.
+struct dev_caps {
+    dev_t src_dev;  // st_dev of the source filesystem
+    dev_t dest_dev; // st_dev of the target filesystem
+    int reflink;    // 1 if FICLONE works, 0 if it doesn't, -1 if not probed yet
+    int direct;     // 1 if both sides accept O_DIRECT, 0 if one doesn't, -1 if not probed yet
+    int probed;     // Set once a worker has started measuring the copy strategies (or they were loaded from the config file)
+    int best;       // Fastest working copy_strategy, -1 if unknown or still being measured
+    unsigned unsupported; // Bit per copy_strategy known not to work for this pair
+    int from_config; // Set if the probe result came from the config file
+};
+
+static struct dev_caps dev_caps_table[MAX_DEV_CAPS];
+static int dev_caps_count = 0;
+static int probe_results_changed = 0; // Set when this run probed a pair that should be saved
+static pthread_mutex_t caps_lock = PTHREAD_MUTEX_INITIALIZER; // Protects adding entries and claiming or publishing a probe
+
+// A file being copied by the io_uring engine
+struct uring_file {
+    int src_fd;         // Source descriptor, owned by the engine
+    int dest_fd;        // Destination descriptor, owned by the engine
+    char *src;          // Source path, for messages
+    char *dest;         // Destination path, for messages
+    mode_t mode;        // Permissions to give the destination
+    off_t size;         // Bytes to copy
+    off_t next_offset;  // First byte not yet queued
+    int inflight;       // Chunks queued but not finished
+    int failed;         // errno of the first failure, 0 if none
+};
+
+// One chunk in flight: a read into the slot's buffer linked to a write from it
+struct uring_slot {
+    struct uring_file *file; // File the chunk belongs to
+    off_t offset;       // Position of the chunk in both files
+    unsigned len;       // Chunk length
+    int read_res;       // Result of the read
+    int write_res;      // Result of the write
+    int pending;        // Completions still expected for this chunk
+};
+
+// State of the io_uring copy engine
+struct uring_engine {
+    int ring_fd;
+    void *sq_ring;      // Mapped submission ring
+    void *cq_ring;      // Mapped completion ring (same mapping with IORING_FEAT_SINGLE_MMAP)
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes; // Mapped submission queue entries
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; // Entries filled in but not yet handed to the kernel
+
+    unsigned depth;     // Number of chunk slots
+    unsigned chunk_size; // Size of each slot's buffer
+    char *buffers;      // depth * chunk_size bytes, one buffer per slot
+    int fixed_buffers;  // Whether the buffers are registered with the kernel
+    struct uring_slot *slots;
+    unsigned *free_slots; // Stack of unused slot indexes
+    unsigned free_count;
+    struct uring_file **files; // Files with chunks still to queue or in flight
+    int file_count;
+};
+
+static struct uring_engine *uring = NULL; // Active io_uring engine, NULL when using the synchronous one
+
+// Counters collected during the run and printed in the final report
+struct backup_stats {
+    unsigned long sparse_files;             // Files copied extent by extent
+    unsigned long long sparse_hole_bytes;   // Bytes of holes skipped instead of read and written
+    unsigned long prealloc_honored;         // Files whose space was reserved before writing
+    unsigned long prealloc_unsupported;     // Files written without preallocation because the target can't do it
+    unsigned long nospace_skipped;          // Files skipped because the target had no room for them
+    unsigned long direct_files;             // Files copied with O_DIRECT
+    unsigned long long direct_bytes;        // Bytes copied with O_DIRECT
+    unsigned long long cache_dropped_bytes; // Source and destination bytes dropped from the page cache
+    unsigned long parallel_files;           // Large files copied in ranges by several threads
+    unsigned long small_files;              // Files copied by the small-file fast path
+    unsigned long shrunk_files;             // Files whose source ended early while being copied
+    long long page_cache_before_kib;        // System page cache size when copying started, -1 if unknown
+    long long page_cache_after_kib;         // System page cache size when copying ended, -1 if unknown
+    unsigned long stream_files;             // Files written to the stream
+    unsigned long long stream_bytes;        // File data written to the stream (headers not included)
+    double stream_seconds;                  // Time from opening the stream to closing it
+    unsigned long sync_batches;             // Batches of files flushed with fdatasync()
+    unsigned long long sync_micros;         // Time spent flushing batches while copying
+    double flush_seconds;                   // Time spent making the backup durable at the end
+    unsigned long sync_errors;              // Files or directories that failed to flush
+    unsigned long btime_files;              // Copied files whose filesystem reported a creation time
+    unsigned long mounts_crossed;           // Directories on a different mount than their parent
+    unsigned long writeback_waits;          // Times the copy waited for an older window to reach the disk
+    unsigned long long writeback_wait_micros; // Time spent in those waits
+    unsigned long write_latency[WRITE_LATENCY_BUCKETS]; // Write calls by duration; bucket i holds [2^i, 2^(i+1)) us, bucket 0 everything under 2 us
+    int walk_workers;                       // Threads that walked the tree, 0 if it was walked on one
+    unsigned long walk_tasks;               // Directories listed and files copied by them
+    unsigned long walk_steals;              // Tasks taken from another worker's queue
+    unsigned long long walk_micros;         // Time from the first task of the parallel traversal to the last
+    unsigned long scheduled_files;          // Files copied largest first after a pre-scan
+    unsigned long long scheduled_bytes;     // Their total size when scanned
+    unsigned long long prescan_micros;      // Time the pre-scan took
+    unsigned long skeleton_dirs;            // Directories created by the skeleton phase
+    unsigned long long skeleton_micros;     // Time the skeleton phase took
+    unsigned long dir_metadata_errors;      // Directories whose permissions or time couldn't be set
+    unsigned long ordered_dirs;             // Directory listings sorted by the order option
+    unsigned long extent_files;             // Files placed by the physical address of their data
+};
+
+static struct backup_stats stats = {
+    .page_cache_before_kib = -1, // Not sampled when streaming
+    .page_cache_after_kib = -1,
+};
+
+// A large file being copied in fixed-size ranges by several threads
+struct range_copy {
+    int src_fd;
+    int dest_fd;
+    off_t size;         // Bytes to copy
+    off_t range_size;   // Bytes per range
+    size_t chunk;       // Buffer size for ranges that can't be copied in the kernel
+    long next_range;    // Index of the next range to hand out, taken atomically
+    int error;          // errno of the first failed range, 0 if none
+};
+
+// Progress of a sequential copy, so the cache-neutral and smoothed writeback
+// modes can act on the pages it has finished with. Writeback of each window
+// of the destination is started as soon as it is written and waited for one
+// window later; in cache-neutral mode the pages are then dropped, along with
+// the source pages already copied.
+struct cache_window {
+    int src_fd;
+    int dest_fd;
+    off_t offset;       // Bytes copied so far
+    off_t src_dropped;  // Source pages before this offset have been dropped
+    off_t dest_started; // Writeback has been started for destination pages before this offset
+    off_t dest_dropped; // Destination pages before this offset are on disk (and dropped in cache-neutral mode)
+};
+
+// Ring of buffers between the reader thread and the writer of a pipelined copy
+struct pipeline {
+    int src_fd;         // File the reader thread reads from
+    size_t chunk;       // Size of each buffer
+    int depth;          // Number of buffers in the ring
+    char **buffers;
+    ssize_t *lengths;   // Bytes in each filled buffer; 0 marks the end of the file, -1 a read error
+    int head;           // Next buffer the reader fills
+    int tail;           // Next buffer the writer drains
+    int count;          // Buffers filled and not yet drained
+    int read_error;     // errno of a failed read
+    int stop;           // Set by the writer to make the reader give up
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  // Signalled when the reader fills a buffer
+    pthread_cond_t drained; // Signalled when the writer frees a buffer
+};
+static long target_fs_type = 0; // statfs() f_type of the backup directory's filesystem
+static blksize_t target_blksize = 4096; // Preferred I/O size of the backup directory's filesystem
+static dev_t target_dev = 0;    // st_dev of the backup directory
+
+// Finished files waiting to be flushed by the batch durability policy
+struct sync_batch {
+    int fds[MAX_SYNC_BATCH_FILES]; // Open destination descriptors
+    int count;
+    off_t bytes;        // Data written to them
+};
+
+static struct sync_batch sync_batch;
+static pthread_mutex_t sync_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static long sync_fds_open = 0;  // Descriptors held by batches, the filling one and those being flushed
+static long sync_fds_limit = LONG_MAX; // How many they may hold within the open file limit
+
+// What statx() can tell about a file beyond struct stat
+struct stat_extra {
+    struct timespec btime;      // Creation time, if has_btime
+    int has_btime;
+    unsigned long long mnt_id;  // Mount the file is on, if has_mnt_id
+    int has_mnt_id;
+};
+
+// Metadata asked of statx() for each kind of lookup: only what that step uses
+#define STAT_TYPE_MASK STATX_TYPE // Classifying an entry
+#define STAT_COPY_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_BLOCKS) // Copying an open file
+#define STAT_STREAM_MASK (STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME) // Writing a tar header
+#define STAT_DIR_MASK (STATX_TYPE | STATX_MODE | STATX_MTIME) // Copying a directory's metadata
+
+// A directory being copied, opened relative to its parent. Its descriptor
+// may be closed when too many are open and is reopened on the next use.
+struct dir_node {
+    struct dir_node *parent; // Directory containing this one, NULL at the top of the tree
+    const char *name;   // Name in the parent, or a path for the top of the tree
+    int fd;             // Open O_DIRECTORY descriptor, -1 if closed
+    unsigned long last_used; // Value of dir_clock when it was last used
+    int pinned;         // Number of callers holding on to the descriptor
+    unsigned long long mnt_id; // Mount the directory is on, 0 if unknown
+};
+
+// The entries of one directory, read in full before any of them is handled
+struct dir_listing {
+    struct dir_entry {
+        unsigned int name;      // Offset of the entry's name in `names`
+        unsigned char type;     // d_type from the directory
+        unsigned long long ino; // d_ino from the directory
+        unsigned long long key; // What the order option sorts by
+    } *entries;
+    size_t count;
+    size_t capacity;
+    char *names;        // The entries' names, each followed by its NUL
+    size_t names_len;
+    size_t names_size;
+};
+
+// One directory level of the single-threaded traversal. The levels from the
+// top of the tree down to the directory being copied form a stack.
+struct copy_frame {
+    struct dir_node src;    // Source directory, opened relative to the level above
+    struct dir_node dest;   // Destination directory
+    struct dir_listing listing; // Its entries; the names of subdirectories are used by the levels below
+    size_t next;            // Index of the next entry to handle
+    size_t src_len;         // Length of the directory's path in the shared source path
+    size_t dest_len;        // Length of the directory's path in the shared destination path
+    struct copy_frame *up;  // Level above, NULL at the top of the tree
+    struct stat dir_stat;   // The source directory's mode and modification time, if has_stat
+    int has_stat;
+};
+
+// A path built up one name at a time as a traversal goes down the tree
+struct path_buffer {
+    char *data;             // The path, NUL-terminated
+    size_t len;
+    size_t size;            // Bytes allocated
+};
+
+// A directory being copied by the parallel traversal. The tasks for its
+// entries share it; it is finished and freed when the last one is done.
+struct walk_dir {
+    struct dir_node src;    // Source side
+    struct dir_node dest;   // Destination side
+    struct walk_dir *parent; // Directory containing this one, kept alive by it
+    int refs;               // Its own listing, plus each task and subdirectory not yet done
+    int depth;              // Levels below the top of the tree
+    int failed;             // Set if its destination couldn't be created by the skeleton phase
+    mode_t mode;            // The source directory's permissions, if has_stat
+    struct timespec mtime;  // The source directory's modification time, if has_stat
+    int has_stat;
+    char name[];            // Name in the parent (empty at the top of the tree)
+};
+
+// A unit of work for the parallel traversal
+struct walk_task {
+    struct walk_dir *dir;   // Directory to list, or the directory holding the file
+    char *name;             // File to copy, NULL to list the directory
+};
+
+// Tasks waiting for one worker. The owner takes the newest task from the
+// tail; idle workers steal the oldest from the head, which are directories
+// near the top of the tree with the most work under them.
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task *tasks;
+    size_t head;            // Oldest task
+    size_t tail;            // One past the newest task
+    size_t capacity;
+};
+
+// A file found by the pre-scan of the largest-first schedule
+struct walk_file {
+    struct walk_dir *dir;   // Directory holding it, which it holds a reference to
+    char *name;
+    off_t size;             // Size when scanned
+};
+
+// What one worker of the parallel traversal did. Each worker only updates
+// its own, so they are kept on separate cache lines.
+struct walk_worker_stats {
+    unsigned long files;            // Files it copied
+    unsigned long long bytes;       // Bytes in them
+    unsigned long long busy_micros; // Time spent on tasks rather than waiting for one
+} __attribute__((aligned(64)));
+
+// What one worker found during the pre-scan
+struct walk_found {
+    struct walk_file *files;
+    size_t file_count;
+    size_t file_capacity;
+    struct walk_dir **dirs; // Subdirectories, still to be created on the target
+    size_t dir_count;
+    size_t dir_capacity;
+};
+
+// State shared by the workers of the parallel traversal
+struct walk_pool {
+    struct walk_deque *deques; // One per worker
+    int workers;
+    struct walk_found *found; // One per worker while pre-scanning for the largest-first schedule, otherwise NULL
+    struct walk_dir **skeleton; // Directories of the depth the skeleton phase is creating
+    size_t skeleton_count;
+    size_t skeleton_next;   // Index of the next one to create
+    struct walk_file *schedule; // Every file found, largest first, once the pre-scan is over
+    size_t schedule_count;
+    size_t schedule_next;   // Index of the next file to hand out
+    unsigned long pending;  // Tasks queued or running; the traversal is over when none are left
+    unsigned long queued;   // Tasks waiting in a deque
+    int sleepers;           // Workers waiting for a task to be queued
+    pthread_mutex_t lock;   // Held while going to sleep and when waking sleepers
+    pthread_cond_t wakeup;  // Signalled when a task is queued or the traversal is over
+};
+
+static struct dir_node *open_dirs[MAX_OPEN_DIRS + 2 * MAX_JOBS + 1]; // Directories with an open descriptor (pinned ones may exceed MAX_OPEN_DIRS)
+static int open_dir_count = 0;
+static unsigned long dir_clock = 0;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the three above and every dir_node's fd and pinned
+static struct walk_pool *walk = NULL; // Active parallel traversal, NULL when walking the tree on one thread
+static struct walk_worker_stats walk_worker_stats[MAX_JOBS];
+
+static int stream_fd = -1;      // Sink of the stream option, -1 when writing a backup directory
+static enum stream_method stream_method = STREAM_READ_WRITE;
+static off_t stream_offset = 0; // Bytes written to the stream so far
+static struct timespec stream_started;
+
+static __thread char *io_buffer = NULL; // Heap buffer reused by every buffered copy on this thread
+static __thread size_t io_buffer_size = 0;
+static __thread char *small_file_arena = NULL; // Slab that holds a whole small file on this thread
+static __thread char *dirent_buffer = NULL; // DIRENT_BUFFER_SIZE bytes for getdents64() on this thread
+static __thread int splice_pipe[2] = { -1, -1 }; // Pipe used by the splice strategy on this thread
+static __thread int splice_pipe_size = 0;
+static __thread struct walk_worker_stats *worker_stats = NULL; // This thread's entry of walk_worker_stats, if it's a traversal worker
+
 // Function prototypes
 void create_timestamped_dir(const char *base_path, char *timestamped_dir);  // Create a timestamped directory
-void copy_file(const char *src, const char *dest);                          // Copy a single file
+void copy_file_at(int src_dirfd, int dest_dirfd, const char *name, const char *src, const char *dest); // Copy a single file
+int copy_data_reflink(int src_fd, int dest_fd, const struct stat *src_stat); // Clone file extents with FICLONE if the device pair supports it
+int copy_data_sparse(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Copy only the data extents of a sparse file
+int preallocate_file(int dest_fd, off_t size);                              // Reserve space for a destination file before writing it
+int copy_data_direct(int src_fd, int dest_fd, const struct stat *src_stat); // Copy a very large file with O_DIRECT, bypassing the page cache
+int copy_data_parallel(int src_fd, int dest_fd, const struct stat *src_stat); // Copy a large file in ranges on several threads
+void *range_copy_worker(void *arg);                                         // Helper thread of a parallel range copy
+void range_copy_ranges(struct range_copy *copy);                            // Copy ranges of a file until none are left
+int copy_data_pipelined(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Copy a large file with reading and writing overlapped
+void *pipeline_reader(void *arg);                                           // Reader thread of a pipelined copy
+int copy_data_chain(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window, int dest_dirfd); // Copy with the best working strategy for the device pair
+void probe_copy_strategies(int src_fd, const struct stat *src_stat, struct dev_caps *caps, int dest_dirfd); // Find which strategies work and which is fastest
+int copy_data_kernel(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Strategy: copy_file_range()
+int copy_data_sendfile(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Strategy: sendfile()
+int copy_data_splice(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Strategy: splice() through a pipe
+int copy_data_mmap(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Strategy: write() from a mapping of the source
+int copy_data_buffered(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window); // Strategy: read() and write() through a buffer
+int *get_splice_pipe();                                                     // Get this thread's pipe for splice(), creating it if needed
+int copy_range(int src_fd, int dest_fd, off_t offset, off_t len, size_t chunk, struct cache_window *window); // Copy one byte range between two files at the same offset
+void cache_window_start(struct cache_window *window, int src_fd, int dest_fd); // Begin tracking a copy for the cache-neutral mode
+void cache_window_advance(struct cache_window *window, off_t offset);      // Record copy progress and drop pages a window behind it
+void cache_window_finish(struct cache_window *window);                      // Write back and drop whatever the copy left cached
+size_t cache_window_chunk();                                                // Largest amount to copy between two progress reports
+off_t cache_window_size();                                                  // Bytes between writeback steps, 0 if no mode needs them
+void record_write_latency(const struct timespec *start);                    // Count a write call that started at `start` in the latency histogram
+long long read_page_cache_kib();                                            // Size of the page cache from /proc/meminfo
+size_t choose_buffer_size(const struct stat *src_stat);                     // Pick the I/O chunk size for a file
+char *get_io_buffer(size_t size);                                           // Get this thread's I/O buffer, growing it if needed
+void release_io_buffer();                                                   // Free this thread's I/O buffers
+int pwrite_all(int fd, const char *buffer, size_t len, off_t offset);        // Write a whole buffer at an offset, resuming after short writes
+void finish_file_copy(int dest_fd, mode_t mode, const char *src, const char *dest); // Apply a copied file's permissions and report it
+int copy_data_small(int src_fd, int dest_fd, const struct stat *src_stat);  // Copy a small file with a single read() and write()
+void uring_engine_init();                                                   // Set up the io_uring engine, or fall back to the synchronous one
+void uring_copy_file(int src_fd, int dest_fd, const struct stat *src_stat, const char *src, const char *dest); // Queue a file on the io_uring engine
+void uring_fill();                                                          // Queue chunks until every io_uring slot is busy
+void uring_queue_rw(unsigned index, int is_write, unsigned char flags);      // Fill in one read or write submission entry
+void uring_enter(unsigned min_complete);                                    // Submit queued entries and optionally wait for completions
+void uring_reap(unsigned min_complete);                                     // Wait for and handle completions
+int uring_process_completions();                                            // Handle every completion that is ready
+void uring_complete_slot(unsigned index);                                   // Finish a chunk once its read and write are done
+void uring_finish_file(struct uring_file *file);                            // Close and report a file the engine is done with
+void uring_engine_finish();                                                 // Drain and tear down the io_uring engine
 void copy_directory(const char *src, const char *dest);                     // Copy a directory recursively
+void copy_directory_serial(const char *src, const char *dest);              // Copy a directory's contents on this thread, without recursion
+struct copy_frame *copy_frame_enter(struct copy_frame *up, const char *src_name, const char *dest_name,
+                                    struct path_buffer *src_path, struct path_buffer *dest_path); // Open and list a directory for the serial traversal
+void copy_frame_leave(struct copy_frame *frame);                            // Close and free a finished level of the serial traversal
+void path_push(struct path_buffer *path, const char *name);                 // Append a name to a shared path
+void path_truncate(struct path_buffer *path, size_t len);                   // Cut a shared path back to a given length
+int dir_node_fd(struct dir_node *node);                                     // Get a directory's descriptor, reopening it if needed
+int dir_node_acquire(struct dir_node *node);                                // Get a directory's descriptor and keep it open until released
+void dir_node_release(struct dir_node *node);                               // Let a directory's descriptor be closed again
+int dir_node_open(struct dir_node *node);                                   // Get a directory's descriptor with dir_lock held
+void dir_node_close(struct dir_node *node);                                 // Close a directory's descriptor
+int stat_directory(struct dir_node *src_dir, int src_dirfd, const char *src, unsigned int mask, struct stat *dir_stat); // Look up a source directory and check its mount
+int classify_entry(int dirfd, const char *name, unsigned char d_type, mode_t *type); // Find whether a directory entry is a directory or a file
+void walk_copy_tree(const char *src, const char *dest);                     // Copy a directory's contents with several traversal workers
+int walk_run(void *(*worker)(void *));                                      // Run a traversal function on every worker thread
+void *walk_worker(void *arg);                                               // Run traversal tasks until the tree is done
+void *walk_schedule_worker(void *arg);                                      // Copy scheduled files until none are left
+int compare_walk_files(const void *a, const void *b);                       // qsort() comparison putting larger files first
+void walk_worker_busy(const struct timespec *start);                        // Add the time since `start` to this worker's busy time
+void walk_build_skeleton(struct walk_dir **dirs, size_t count);             // Create the directories found by the pre-scan, one depth at a time
+void *walk_skeleton_worker(void *arg);                                      // Create directories of the current depth until none are left
+void walk_make_directory(struct walk_dir *dir);                             // Create one directory of the skeleton
+int compare_walk_dirs(const void *a, const void *b);                        // qsort() comparison ordering directories by depth, then parent
+void finish_directory(int dest_dirfd, mode_t mode, const struct timespec *mtime, const char *dest); // Give a finished directory its source's permissions and time
+int walk_next_task(int self, struct walk_task *task);                       // Take a task from a worker's deque or steal one
+void walk_push(int self, struct walk_dir *dir, char *name);                 // Queue a traversal task on a worker's deque
+void walk_list_directory(int self, struct walk_dir *dir);                   // List a directory and queue its entries
+void walk_copy_file(struct walk_dir *dir, char *name);                      // Copy one file found by the traversal
+struct walk_dir *walk_dir_new(struct walk_dir *parent, const char *name);   // Set up a directory for the parallel traversal
+char *walk_dir_path(const struct walk_dir *dir, int dest, const char *name); // Build the full path of a directory or of an entry in it
+void walk_dir_put(struct walk_dir *dir);                                    // Drop a reference to a directory, finishing it after the last
+char *path_join(const char *dir, const char *name);                         // Join a path and a name into a new string
+int read_dir_listing(int dir_fd, struct dir_listing *listing);              // Read all entries of a directory with getdents64()
+void free_dir_listing(struct dir_listing *listing);                         // Free a directory listing
+void order_dir_listing(int dir_fd, struct dir_listing *listing);            // Sort a listing by inode or by physical extent
+int compare_dir_entries(const void *a, const void *b);                      // qsort() comparison of two listing entries
+int first_extent(int dir_fd, const char *name, unsigned long long *physical); // Physical address of a file's first data extent
+int device_is_rotational(dev_t dev);                                        // Whether sysfs reports a block device as rotational
+int stat_at(int dirfd, const char *name, int flags, unsigned int mask, struct stat *st, struct stat_extra *extra); // statx() just the fields asked for, with a fallback
+void stream_open(const char *sink);                                         // Open the sink of the stream option
+void stream_close();                                                        // End the tar stream and close its sink
+void stream_write(const void *buffer, size_t len);                          // Write a whole buffer to the stream, exiting on failure
+void stream_header(const char *name, const struct stat *st, char type);     // Write the tar header of one archive member
+void stream_pad(off_t len);                                                 // Pad a member to a whole number of tar blocks
+ssize_t stream_data(int src_fd, off_t *offset, size_t len);                 // Move file data to the stream with the current method
+void stream_directory(const struct stat *dir_stat, const char *name);       // Add a directory to the stream
+void stream_file(int src_dirfd, const char *src_name, const char *src, const char *name); // Add a regular file to the stream
+void durability_file_done(int dest_fd, off_t bytes);                        // Close a finished destination file or add it to the flush batch
+void durability_flush_batch(struct sync_batch *batch);                      // fdatasync() and close the files of a batch
+int durability_flush_now();                                                 // Flush the current batch early to free its descriptors
+void durability_sync_directory(int dir_fd, const char *path);               // fsync() a directory
+void durability_finish(const char *backup_dir, const char *target_dir);     // Make the finished backup durable
 void handle_error(const char *msg);                                         // Handle errors and print messages
 void read_default_backup_dir(char *default_target_dir);                     // Read default backup directory from config file
 void write_default_backup_dir(const char *new_default_dir);                 // Write new default backup directory to config file
 void ensure_config_dir_exists(const char *config_path);                     // Ensure config directory exists
+void read_config_options();                                                 // Apply the "key=value" option lines of the config file
+int parse_size(const char *text, unsigned long long *size);                 // Parse a size such as "512K" or "8M"
+int apply_option(const char *option);                                       // Parse and apply a "-o key[=value]" option
+struct dev_caps *get_dev_caps(dev_t src_dev, dev_t dest_dev);               // Find or add the capability entry for a device pair
+int load_probe_result(const char *value);                                   // Restore a probe result saved in the config file
+void save_probe_results(const char *default_dir);                           // Save this run's probe results in the config file
+void print_backup_report();                                                 // Print the end-of-run statistics
+void format_bytes(unsigned long long bytes, char *out, size_t out_size);    // Format a byte count for humans (e.g. "1.5 GiB")
+const char *fs_type_name(long fs_type);                                     // Name of a filesystem from its statfs() magic number
 void random_delay();                                                        // To make things look more profesional :)
 
+// Copy strategies, indexed by enum copy_strategy
+static int (*const copy_strategies[STRATEGY_COUNT])(int, int, const struct stat *, struct cache_window *) = {
+    copy_data_kernel,
+    copy_data_sendfile,
+    copy_data_splice,
+    copy_data_mmap,
+    copy_data_buffered,
+};
+
 int main(int argc, char *argv[]) {
     char target_dir[PATH_MAX];  // Writable buffer for target directory
     strcpy(target_dir, DEFAULT_TARGET_DIR); // Initialize with default value
@@ -45,8 +690,11 @@ int main(int argc, char *argv[]) {
 
     fprintf(stderr, GRAY "[DEBUG] Starting backup tool.\n" RESET);
 
+    // Options from the config file come first so the command line can override them
+    read_config_options();
+
     // Parse command-line arguments
-    while ((opt = getopt(argc, argv, "t:")) != -1) {
+    while ((opt = getopt(argc, argv, "t:o:j:")) != -1) {
         switch (opt) {
         case 't':
             random_delay();
@@ -57,10 +705,27 @@ int main(int argc, char *argv[]) {
             }
             update_default = 1; // Mark for updating the default target directory
             break;
+        case 'o':
+            random_delay();
+            fprintf(stderr, GRAY "[DEBUG] -o option provided with argument: %s\n" RESET, optarg);
+            if (apply_option(optarg) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j': {
+            random_delay();
+            fprintf(stderr, GRAY "[DEBUG] -j option provided with argument: %s\n" RESET, optarg);
+            char jobs[32];
+            snprintf(jobs, sizeof(jobs), "jobs=%.20s", optarg); // Same as "-o jobs=N"
+            if (apply_option(jobs) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
         default:
             random_delay();
             fprintf(stderr, RED "   [ERROR] Invalid usage.\n" RESET);
-            fprintf(stderr, "Usage: %s [-t target_dir] source_dir\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-t target_dir] [-j jobs] [-o option[=value]]... source_dir\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
@@ -83,7 +748,7 @@ int main(int argc, char *argv[]) {
     if (optind >= argc) {
         random_delay();
         fprintf(stderr, RED "   [ERROR] Expected source_dir after options.\n" RESET);
-        fprintf(stderr, "Usage: %s [-t target_dir] source_dir\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-t target_dir] [-j jobs] [-o option[=value]]... source_dir\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -97,6 +762,38 @@ int main(int argc, char *argv[]) {
         perror(RED "Invalid source directory" RESET);
         exit(EXIT_FAILURE);
     }
+    if (options.order == ORDER_AUTO) {
+        // A disk head pays for every jump; flash doesn't care about the order
+        options.order = device_is_rotational(src_stat.st_dev) ? ORDER_INODE : ORDER_NONE;
+        if (options.order == ORDER_INODE) {
+            random_delay();
+            fprintf(stderr, GRAY "[DEBUG] Source is on a rotational disk; handling files in inode order.\n" RESET);
+        }
+    }
+
+    if (options.jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.jobs = cpus < 1 ? 1 : cpus;
+    }
+    if (options.jobs > MAX_JOBS) {
+        options.jobs = MAX_JOBS;
+    }
+
+    if (options.stream) {
+        // The archive holds a single timestamped directory, like a backup would
+        create_timestamped_dir(".", backup_dir);
+        const char *archive_root = backup_dir + 2; // Without the "./"
+        stream_open(options.stream);
+        random_delay();
+        printf("Streaming '%s' to '%s' as '%s'\n", source_dir, options.stream, archive_root);
+        copy_directory(source_dir, archive_root);
+        stream_close();
+
+        print_backup_report();
+        random_delay();
+        printf("Stream completed successfully!\n");
+        return 0;
+    }
 
     // Create timestamped backup directory
     random_delay();
@@ -106,14 +803,60 @@ int main(int argc, char *argv[]) {
         perror(RED "Failed to create backup directory" RESET);
         exit(EXIT_FAILURE);
     }
+    struct statfs target_fs;
+    if (statfs(backup_dir, &target_fs) == 0) { // Every destination file lives on this filesystem
+        target_fs_type = target_fs.f_type;
+        target_blksize = target_fs.f_bsize;
+    }
+    struct stat target_stat;
+    if (stat(backup_dir, &target_stat) == 0) {
+        target_dev = target_stat.st_dev;
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] Target filesystem type: %s\n" RESET, fs_type_name(target_fs_type));
+    }
 
     random_delay();
     printf("Backing up '%s' to '%s'\n", source_dir, backup_dir);
     random_delay();
     fprintf(stderr, GRAY "[DEBUG] Starting backup process.\n" RESET);
 
+    if (options.sync_batch_files > MAX_SYNC_BATCH_FILES) {
+        options.sync_batch_files = MAX_SYNC_BATCH_FILES;
+    }
+    struct rlimit fd_limit;
+    if (options.durability == DURABILITY_BATCH && getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur != RLIM_INFINITY) {
+        // Every file of a batch keeps its descriptor until the batch is
+        // flushed, so leave room for the directories and the workers' files
+        long spare = (long)fd_limit.rlim_cur - FDS_RESERVED - MAX_OPEN_DIRS - (long)options.jobs * FDS_PER_JOB;
+        sync_fds_limit = spare > 1 ? spare : 1;
+        if (sync_fds_limit < 2L * options.sync_batch_files) {
+            // Half for the batch being filled, half for the one before it being flushed
+            options.sync_batch_files = sync_fds_limit / 2 > 1 ? sync_fds_limit / 2 : 1;
+            random_delay();
+            fprintf(stderr, GRAY "[DEBUG] Open file limit is %llu; flushing batches of at most %d files.\n" RESET,
+                    (unsigned long long)fd_limit.rlim_cur, options.sync_batch_files);
+        }
+    }
+    if (options.engine == ENGINE_URING) {
+        uring_engine_init();
+    }
+    stats.page_cache_before_kib = read_page_cache_kib();
+
     // Copy the source directory
     copy_directory(source_dir, backup_dir);
+    uring_engine_finish(); // Wait for files still in flight
+    durability_finish(backup_dir, target_dir); // Only report success once the data is safe
+    stats.page_cache_after_kib = read_page_cache_kib();
+    if (probe_results_changed) {
+        save_probe_results(target_dir);
+    }
+
+    print_backup_report();
+    if (stats.sync_errors > 0) {
+        random_delay();
+        fprintf(stderr, RED "[FATAL] The backup could not be fully written to the target; do not rely on it.\n" RESET);
+        exit(EXIT_FAILURE);
+    }
 
     random_delay();
     fprintf(stderr, GRAY "[DEBUG] Backup process completed successfully.\n" RESET);
@@ -123,6 +866,142 @@ int main(int argc, char *argv[]) {
 }
 
 
+// Parse a "key[=value]" option string and store the value in `options`.
+// Returns 0 on success or -1 (after printing an error) if it is invalid.
+int apply_option(const char *option) {
+    const char *equals = strchr(option, '=');
+    size_t key_len = equals ? (size_t)(equals - option) : strlen(option);
+    const char *value = equals ? equals + 1 : NULL;
+
+    for (size_t i = 0; i < sizeof(option_defs) / sizeof(option_defs[0]); i++) {
+        const struct option_def *def = &option_defs[i];
+        if (strlen(def->key) != key_len || strncmp(def->key, option, key_len) != 0) {
+            continue;
+        }
+
+        switch (def->type) {
+        case OPT_BOOL:
+            if (value == NULL || strcmp(value, "1") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "on") == 0) {
+                *(int *)def->value = 1;
+            } else if (strcmp(value, "0") == 0 || strcmp(value, "no") == 0 || strcmp(value, "off") == 0) {
+                *(int *)def->value = 0;
+            } else {
+                fprintf(stderr, RED "   [ERROR] Option '%s' expects a yes/no value, got: %s\n" RESET, def->key, value);
+                return -1;
+            }
+            return 0;
+        case OPT_INT: {
+            char *end;
+            long number = value ? strtol(value, &end, 10) : 0;
+            if (value == NULL || *value == '\0' || *end != '\0' || number < 1 || number > INT_MAX) {
+                fprintf(stderr, RED "   [ERROR] Option '%s' expects a positive number, got: %s\n" RESET, def->key, value ? value : "(none)");
+                return -1;
+            }
+            *(int *)def->value = (int)number;
+            return 0;
+        }
+        case OPT_SIZE: {
+            unsigned long long size;
+            if (value == NULL || parse_size(value, &size) != 0) {
+                fprintf(stderr, RED "   [ERROR] Option '%s' expects a size such as 64K or 8M, got: %s\n" RESET, def->key, value ? value : "(none)");
+                return -1;
+            }
+            if (def->value == &options.buffer_size && size > MAX_BUFFER_SIZE) {
+                fprintf(stderr, RED "   [ERROR] Option '%s' can be at most 1G, got: %s\n" RESET, def->key, value);
+                return -1;
+            }
+            *(unsigned long long *)def->value = size;
+            return 0;
+        }
+        case OPT_STRING:
+            if (value == NULL || *value == '\0') {
+                fprintf(stderr, RED "   [ERROR] Option '%s' expects a value.\n" RESET, def->key);
+                return -1;
+            }
+            free(*(char **)def->value);
+            *(char **)def->value = strdup(value);
+            return 0;
+        case OPT_PROBE:
+            if (value == NULL || load_probe_result(value) != 0) {
+                fprintf(stderr, RED "   [ERROR] Invalid probe result: %s\n" RESET, value ? value : "(none)");
+                return -1;
+            }
+            return 0;
+        case OPT_CHOICE:
+            for (int c = 0; value && def->choices[c]; c++) {
+                if (strcmp(value, def->choices[c]) == 0) {
+                    *(int *)def->value = c;
+                    return 0;
+                }
+            }
+            fprintf(stderr, RED "   [ERROR] Invalid value for option '%s': %s\n" RESET, def->key, value ? value : "(none)");
+            return -1;
+        }
+    }
+
+    fprintf(stderr, RED "   [ERROR] Unknown option: %.*s\n" RESET, (int)key_len, option);
+    return -1;
+}
+
+// Parse a size made of a number and an optional K, M or G suffix (powers of
+// 1024, "KiB"/"KB" spellings accepted). Returns 0 on success or -1 if invalid.
+int parse_size(const char *text, unsigned long long *size) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if (end == text || errno != 0 || *text == '-') {
+        return -1;
+    }
+
+    unsigned long long multiplier = 1;
+    switch (*end) {
+    case 'k': case 'K': multiplier = 1ULL << 10; end++; break;
+    case 'm': case 'M': multiplier = 1ULL << 20; end++; break;
+    case 'g': case 'G': multiplier = 1ULL << 30; end++; break;
+    case 't': case 'T': multiplier = 1ULL << 40; end++; break;
+    }
+    if (multiplier > 1 && (strcmp(end, "iB") == 0 || strcmp(end, "B") == 0)) {
+        end += strlen(end);
+    }
+    if (*end != '\0' || number > ULLONG_MAX / multiplier) {
+        return -1;
+    }
+    *size = number * multiplier;
+    return 0;
+}
+
+// Apply the option lines of the config file. The first line holds the default
+// backup directory; each following line is a "key=value" option in the same
+// form as "-o". Blank lines and lines starting with '#' are ignored.
+void read_config_options() {
+    struct passwd *pw = getpwuid(getuid());
+    const char *homedir = pw->pw_dir;
+
+    char config_path[PATH_MAX];
+    snprintf(config_path, sizeof(config_path), CONFIG_FILE_PATH, homedir);
+
+    FILE *config_file = fopen(config_path, "r");
+    if (!config_file) {
+        return; // Reported later when the default directory is read
+    }
+
+    char line[PATH_MAX];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), config_file) != NULL) {
+        line_number++;
+        line[strcspn(line, "\n")] = 0;
+        if (line_number == 1 || line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] Config file option: %s\n" RESET, line);
+        if (apply_option(line) != 0) {
+            fprintf(stderr, YELLOW "   [WARNING] Ignoring line %d of config file: %s\n" RESET, line_number, config_path);
+        }
+    }
+    fclose(config_file);
+}
+
 // Function to read default backup directory from config file
 void read_default_backup_dir(char *default_target_dir) {
     struct passwd *pw = getpwuid(getuid());
@@ -190,6 +1069,25 @@ void write_default_backup_dir(const char *new_default_dir) {
     // Ensure the config directory exists
     ensure_config_dir_exists(config_path);
     
+    // Keep the option lines that follow the directory
+    char *option_lines = NULL;
+    size_t option_lines_len = 0;
+    FILE *old_config = fopen(config_path, "r");
+    if (old_config) {
+        int c;
+        while ((c = fgetc(old_config)) != EOF && c != '\n') {
+            // Skip the old default directory
+        }
+        FILE *rest = open_memstream(&option_lines, &option_lines_len);
+        while (rest && (c = fgetc(old_config)) != EOF) {
+            fputc(c, rest);
+        }
+        if (rest) {
+            fclose(rest);
+        }
+        fclose(old_config);
+    }
+
     random_delay();
     fprintf(stderr, GRAY "[DEBUG] Writing new default directory to config file: %s\n" RESET, config_path);
 
@@ -197,12 +1095,16 @@ void write_default_backup_dir(const char *new_default_dir) {
     if (config_file) {
         random_delay();
         fprintf(config_file, "%s", new_default_dir);
+        if (option_lines_len > 0) {
+            fprintf(config_file, "\n%s", option_lines);
+        }
         fclose(config_file);
         random_delay();
         fprintf(stderr, GRAY "[DEBUG] Config file updated successfully.\n" RESET);
     } else {
         perror(RED "Failed to update default backup directory" RESET);
     }
+    free(option_lines);
 }
 
 // Create a timestamped directory name
@@ -232,10 +1134,14 @@ void create_timestamped_dir(const char *base_path, char *timestamped_dir) {
     }
 }
 
-// Copy a single file
-void copy_file(const char *src, const char *dest) {
-    FILE *src_file = fopen(src, "rb"); // Open the source file in binary mode for reading
-    if (!src_file) {
+// Copy the file `name` from the directory `src_dirfd` to the directory
+// `dest_dirfd`. `src` and `dest` are its full paths, for messages.
+void copy_file_at(int src_dirfd, int dest_dirfd, const char *name, const char *src, const char *dest) {
+    int src_fd = openat(src_dirfd, name, O_RDONLY); // Open the source file for reading
+    if (src_fd < 0 && errno == EMFILE && durability_flush_now() > 0) {
+        src_fd = openat(src_dirfd, name, O_RDONLY); // The flush closed the batch's descriptors
+    }
+    if (src_fd < 0) {
         perror(RED "Failed to open source file" RESET); // Print error if the source file cannot be opened
         random_delay();
         fprintf(stderr, RED "   [ERROR] Could not open source file: %s\n" RESET, src);
@@ -244,115 +1150,3439 @@ void copy_file(const char *src, const char *dest) {
     random_delay();
     fprintf(stderr, GRAY "   [INFO] Opened source file: %s\n" RESET, src);
 
-    FILE *dest_file = fopen(dest, "wb"); // Open the destination file in binary mode for writing
-    if (!dest_file) {
+    // Size, blocks, device and mode of the open file drive everything below
+    struct stat src_stat;
+    struct stat_extra src_extra;
+    if (stat_at(src_fd, "", AT_EMPTY_PATH, STAT_COPY_MASK, &src_stat, &src_extra) != 0) {
+        perror(RED "Failed to retrieve file metadata" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not stat source file: %s\n" RESET, src);
+        close(src_fd);
+        return;
+    }
+
+    int dest_fd = openat(dest_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666); // Create or truncate the destination file
+    if (dest_fd < 0 && errno == EMFILE && durability_flush_now() > 0) {
+        dest_fd = openat(dest_dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (dest_fd < 0) {
         perror(RED "Failed to open destination file" RESET); // Print error if the destination file cannot be opened
         random_delay();
         fprintf(stderr, RED "   [ERROR] Could not open destination file: %s\n" RESET, dest);
-        fclose(src_file); // Close the source file to avoid resource leaks
+        close(src_fd); // Close the source file to avoid resource leaks
         return;
     }
     random_delay();
     fprintf(stderr, GRAY "   [INFO] Created destination file: %s\n" RESET, dest);
+    if (src_extra.has_btime) {
+        __atomic_fetch_add(&stats.btime_files, 1, __ATOMIC_RELAXED);
+    }
 
-    char buffer[4096]; // Buffer to temporarily store file data
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src_file)) > 0) { // Read data into the buffer
-        if (fwrite(buffer, 1, bytes, dest_file) != bytes) { // Write buffer contents to destination
-            perror(RED "Failed to write to destination file" RESET);
-            random_delay();
-            fprintf(stderr, RED "   [ERROR] Write error occurred while copying file: %s -> %s\n" RESET, src, dest);
-            break; // Exit loop on write failure
-        }
+    // Clone extents if asked to, copy small files in one go, skip the holes
+    // of sparse files, use one of the large-file modes where they apply,
+    // and otherwise use the best copy strategy for this device pair
+    int result = 1;
+    if (options.reflink) {
+        result = copy_data_reflink(src_fd, dest_fd, &src_stat);
+    }
+    if (result > 0 && (unsigned long long)src_stat.st_size <= options.small_file_max
+        && src_stat.st_size <= MAX_SMALL_FILE) {
+        result = copy_data_small(src_fd, dest_fd, &src_stat);
+    }
+    struct cache_window window;
+    cache_window_start(&window, src_fd, dest_fd);
+    if (result > 0) {
+        result = copy_data_sparse(src_fd, dest_fd, &src_stat, &window);
+    }
+    if (result > 0 && options.prealloc && preallocate_file(dest_fd, src_stat.st_size) != 0) {
+        // Better to skip the file now than to run out of space halfway through it
+        perror(RED "Failed to preallocate destination file" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Not enough space on target, skipping file: %s\n" RESET, src);
+        close(src_fd);
+        close(dest_fd);
+        unlinkat(dest_dirfd, name, 0);
+        __atomic_fetch_add(&stats.nospace_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (result > 0 && options.direct_threshold > 0
+        && (unsigned long long)src_stat.st_size >= options.direct_threshold) {
+        result = copy_data_direct(src_fd, dest_fd, &src_stat);
+    }
+    if (result > 0 && uring) {
+        uring_copy_file(src_fd, dest_fd, &src_stat, src, dest); // The engine finishes the file once its data is written
+        return;
+    }
+    if (result > 0 && options.file_jobs > 1 && options.range_size > 0
+        && (unsigned long long)src_stat.st_size >= 2 * options.range_size) {
+        result = copy_data_parallel(src_fd, dest_fd, &src_stat);
+    }
+    if (result > 0 && options.pipeline_threshold > 0 && src_stat.st_dev != target_dev
+        && (unsigned long long)src_stat.st_size >= options.pipeline_threshold) {
+        result = copy_data_pipelined(src_fd, dest_fd, &src_stat, &window);
+    }
+    if (result > 0) {
+        result = copy_data_chain(src_fd, dest_fd, &src_stat, &window, dest_dirfd);
+    }
+    if (result == COPY_SHORT) {
+        // Someone truncated the source after it was opened: keep what it has now
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] Source file shrank while being copied, %lld of %lld bytes copied: %s\n" RESET,
+                (long long)window.offset, (long long)src_stat.st_size, src);
+        __atomic_fetch_add(&stats.shrunk_files, 1, __ATOMIC_RELAXED);
+        result = ftruncate(dest_fd, window.offset) == 0 ? 0 : -1;
+    }
+    if (result == 0) {
+        cache_window_finish(&window);
+    }
+    if (result < 0) {
+        perror(RED "Failed to write to destination file" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Write error occurred while copying file: %s -> %s\n" RESET, src, dest);
+    }
+
+    finish_file_copy(dest_fd, src_stat.st_mode, src, dest);
+    close(src_fd); // Close the source file
+    durability_file_done(dest_fd, src_stat.st_size); // Close the destination file, or keep it to flush later
+    if (worker_stats && result == 0) {
+        worker_stats->files++;
+        worker_stats->bytes += src_stat.st_size;
     }
+}
+
+// Give a copied file the source file's permissions (from the fstat() taken
+// when it was opened) and report it. Called before the destination is closed.
+void finish_file_copy(int dest_fd, mode_t mode, const char *src, const char *dest) {
+    int chmod_result = fchmod(dest_fd, mode & 07777); // Apply the same permissions to the destination file
+    int chmod_errno = errno;
 
-    fclose(src_file); // Close the source file
-    fclose(dest_file); // Close the destination file
     random_delay();
     fprintf(stderr, GRAY "   [INFO] File copy completed: %s -> %s\n" RESET, src, dest);
 
-    // Copy file permissions from source to destination
-    struct stat src_stat;
-    if (stat(src, &src_stat) == 0) { // Retrieve source file metadata
-        if (chmod(dest, src_stat.st_mode) != 0) { // Apply the same permissions to the destination file
-            perror(RED "Failed to set file permissions" RESET);
+    if (chmod_result != 0) {
+        errno = chmod_errno;
+        perror(RED "Failed to set file permissions" RESET);
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] Permissions not set correctly for: %s\n" RESET, dest);
+    } else {
+        random_delay();
+        fprintf(stderr, GRAY "   [INFO] Permissions set successfully for: %s\n" RESET, dest);
+    }
+}
+
+// Copy a small file with a single read() into this thread's arena and a
+// single write() from it, skipping preallocation and the other per-file
+// set-up of the general path. Empty files need no data I/O at all.
+// Returns 0 on success, -1 on error (errno set), or 1 if the arena can't be
+// allocated.
+int copy_data_small(int src_fd, int dest_fd, const struct stat *src_stat) {
+    size_t size = src_stat->st_size;
+    __atomic_fetch_add(&stats.small_files, 1, __ATOMIC_RELAXED);
+    if (size == 0) {
+        return 0;
+    }
+
+    if (!small_file_arena) {
+        size_t arena_size = options.small_file_max < MAX_SMALL_FILE ? options.small_file_max : MAX_SMALL_FILE;
+        small_file_arena = malloc(arena_size);
+        if (!small_file_arena) {
+            __atomic_fetch_sub(&stats.small_files, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+
+    size_t len = 0;
+    while (len < size) { // One read() unless the file is being changed under us
+        ssize_t bytes = read(src_fd, small_file_arena + len, size - len);
+        if (bytes == 0) {
+            break;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        len += bytes;
+    }
+    return pwrite_all(dest_fd, small_file_arena, len, 0);
+}
+
+// Share the source file's extents with the destination using the FICLONE
+// ioctl (btrfs, XFS and other copy-on-write filesystems), so no data is
+// copied until one side is modified. Support is probed once per device pair.
+// Returns 0 on success, -1 on error (errno set), or 1 if cloning isn't
+// possible here and the data has to be copied.
+int copy_data_reflink(int src_fd, int dest_fd, const struct stat *src_stat) {
+    struct dev_caps *caps = get_dev_caps(src_stat->st_dev, target_dev);
+    if (caps && __atomic_load_n(&caps->reflink, __ATOMIC_RELAXED) == 0) {
+        return 1; // Already known not to work for this pair
+    }
+
+    int unknown = -1; // Only the first file to find out reports it
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        if (caps && __atomic_compare_exchange_n(&caps->reflink, &unknown, 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
             random_delay();
-            fprintf(stderr, YELLOW "   [WARNING] Permissions not set correctly for: %s\n" RESET, dest);
-        } else {
+            fprintf(stderr, GRAY "[DEBUG] Reflink supported from device %u:%u to device %u:%u.\n" RESET,
+                    major(src_stat->st_dev), minor(src_stat->st_dev), major(target_dev), minor(target_dev));
+        }
+        return 0;
+    }
+
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL) {
+        if (caps && __atomic_compare_exchange_n(&caps->reflink, &unknown, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
             random_delay();
-            fprintf(stderr, GRAY "   [INFO] Permissions set successfully for: %s\n" RESET, dest);
+            fprintf(stderr, YELLOW "   [WARNING] Reflink not supported from device %u:%u to device %u:%u; copying data instead.\n" RESET,
+                    major(src_stat->st_dev), minor(src_stat->st_dev), major(target_dev), minor(target_dev));
         }
     }
+    return 1; // Anything else (e.g. ENOSPC) may be specific to this file, so just copy it
 }
 
-// Copy a directory recursively
-void copy_directory(const char *src, const char *dest) {
-    DIR *dir = opendir(src); // Open the source directory for reading
-    if (!dir) {
-        perror(RED "Failed to open source directory" RESET);
-        random_delay();
-        fprintf(stderr, RED "   [ERROR] Could not open directory: %s\n" RESET, src);
-        return;
+// Copy a sparse file extent by extent: find each data region with
+// SEEK_DATA/SEEK_HOLE, copy only that, and leave the holes unwritten so the
+// destination gets the same holes. Files that use all their blocks are not
+// treated as sparse. Returns 0 on success, -1 on error (errno set), or 1 if
+// the file isn't sparse or the filesystem can't report holes.
+int copy_data_sparse(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    // A file occupying fewer blocks than its size has holes in it
+    if (src_stat->st_size == 0 || (off_t)src_stat->st_blocks * 512 >= src_stat->st_size) {
+        return 1;
     }
-    fprintf(stderr, GRAY "   [INFO] Opened source directory: %s\n" RESET, src);
 
-    // Attempt to create the destination directory
-    if (mkdir(dest, 0755) != 0 && errno != EEXIST) { // Handle case where directory might already exist
-        perror(RED "Failed to create destination directory" RESET);
-        random_delay();
-        fprintf(stderr, RED "   [ERROR] Could not create destination directory: %s\n" RESET, dest);
-        closedir(dir);
-        return;
+    off_t size = src_stat->st_size;
+    off_t data_bytes = 0;
+    off_t data = 0;
+    while (data < size) {
+        data = lseek(src_fd, data, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break; // Nothing but a hole up to the end of the file
+            }
+            if (data_bytes == 0 && errno == EINVAL) {
+                return 1; // SEEK_DATA isn't supported here; copy the file normally
+            }
+            return -1;
+        }
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            return -1;
+        }
+        if (copy_range(src_fd, dest_fd, data, hole - data, choose_buffer_size(src_stat), window) != 0) {
+            return -1;
+        }
+        data_bytes += hole - data;
+        data = hole;
     }
-    random_delay();
-    fprintf(stderr, GRAY "   [INFO] Destination directory created or already exists: %s\n" RESET, dest);
 
-    struct dirent *entry; // To iterate over directory entries
-    char src_path[PATH_MAX]; // Full path for the source file/directory
-    char dest_path[PATH_MAX]; // Full path for the destination file/directory
+    // Extend the destination over any trailing hole
+    if (ftruncate(dest_fd, size) != 0) {
+        return -1;
+    }
+
+    __atomic_fetch_add(&stats.sparse_files, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.sparse_hole_bytes, size - data_bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Reserve `size` bytes for a new destination file so it's allocated in as few
+// extents as possible, and so a full target is noticed before any data is
+// written. Uses fallocate() directly rather than posix_fallocate(), whose
+// fallback writes zeros over the whole file, and with FALLOC_FL_KEEP_SIZE,
+// so the file's size still only grows as data is written: a source that
+// shrinks while it's copied can't leave a tail of zeros behind. Filesystems
+// without support are remembered and not asked again. Returns 0 if the file
+// can be written (preallocated or not), or -1 with errno ENOSPC or EFBIG if
+// it won't fit.
+int preallocate_file(int dest_fd, off_t size) {
+    static int unsupported = 0;     // Set once the target rejects preallocation (shared by all threads)
 
-    while ((entry = readdir(dir)) != NULL) { // Read each entry in the directory
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue; // Skip current and parent directory entries
+    if (size == 0) {
+        return 0;
+    }
+    while (!__atomic_load_n(&unsupported, __ATOMIC_RELAXED)) {
+        if (fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+            __atomic_fetch_add(&stats.prealloc_honored, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (errno == ENOSPC || errno == EFBIG) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            break; // Unexpected, but the copy itself may still work
+        }
+        if (!__atomic_exchange_n(&unsupported, 1, __ATOMIC_RELAXED)) {
+            random_delay();
+            fprintf(stderr, YELLOW "   [WARNING] Target filesystem (%s) does not support preallocation.\n" RESET,
+                    fs_type_name(target_fs_type));
         }
+    }
+    __atomic_fetch_add(&stats.prealloc_unsupported, 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-        snprintf(src_path, PATH_MAX, "%s/%s", src, entry->d_name); // Construct full source path
-        snprintf(dest_path, PATH_MAX, "%s/%s", dest, entry->d_name); // Construct full destination path
+// Copy a very large file with O_DIRECT on both descriptors so neither the
+// source nor the destination pages end up in the page cache, where they would
+// push out the working set of everything else on the host. Everything up to
+// the last aligned block goes through aligned buffers; the unaligned tail is
+// written through the page cache. Returns 0 on success, -1 on error (errno
+// set), or 1 if either filesystem rejects O_DIRECT (remembered per device
+// pair) so the caller uses a buffered method instead.
+int copy_data_direct(int src_fd, int dest_fd, const struct stat *src_stat) {
+    struct dev_caps *caps = get_dev_caps(src_stat->st_dev, target_dev);
+    if (caps && __atomic_load_n(&caps->direct, __ATOMIC_RELAXED) == 0) {
+        return 1;
+    }
 
-        struct stat entry_stat;
-        if (stat(src_path, &entry_stat) == 0) { // Retrieve metadata for the source entry
-            if (S_ISDIR(entry_stat.st_mode)) { // Check if the entry is a directory
-                random_delay();
-                fprintf(stderr, GRAY "   [INFO] Found directory: %s\n" RESET, src_path);
-                copy_directory(src_path, dest_path); // Recursively copy subdirectory
-            } else if (S_ISREG(entry_stat.st_mode)) { // Check if the entry is a regular file
-                random_delay();
-                fprintf(stderr, GRAY "   [INFO] Found file: %s\n" RESET, src_path);
-                copy_file(src_path, dest_path); // Copy the file
+    int src_flags = fcntl(src_fd, F_GETFL);
+    int dest_flags = fcntl(dest_fd, F_GETFL);
+    if (src_flags < 0 || dest_flags < 0
+        || fcntl(src_fd, F_SETFL, src_flags | O_DIRECT) != 0) {
+        goto unsupported;
+    }
+    if (fcntl(dest_fd, F_SETFL, dest_flags | O_DIRECT) != 0) {
+        fcntl(src_fd, F_SETFL, src_flags);
+        goto unsupported;
+    }
+
+    size_t chunk = choose_buffer_size(src_stat);
+    chunk = (chunk + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+    char *buffer;
+    if (posix_memalign((void **)&buffer, DIRECT_IO_ALIGN, chunk) != 0) {
+        fcntl(src_fd, F_SETFL, src_flags);
+        fcntl(dest_fd, F_SETFL, dest_flags);
+        return 1;
+    }
+
+    int result = 0;
+    off_t offset = 0;
+    while (offset < src_stat->st_size) {
+        ssize_t bytes = pread(src_fd, buffer, chunk, offset);
+        if (bytes == 0) {
+            break;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && offset == 0) {
+                result = 1; // The device wants a larger alignment than ours
             } else {
-                random_delay();
-                fprintf(stderr, YELLOW "   [WARNING] Skipped unknown entry type: %s\n" RESET, src_path);
+                result = -1;
             }
-        } else {
-            perror("Failed to retrieve file metadata");
-            random_delay();
-            fprintf(stderr, YELLOW "   [WARNING] Could not stat entry: %s\n" RESET, src_path);
+            break;
+        }
+
+        size_t aligned = bytes & ~(size_t)(DIRECT_IO_ALIGN - 1);
+        if (aligned > 0 && pwrite_all(dest_fd, buffer, aligned, offset) != 0) {
+            result = errno == EINVAL && offset == 0 ? 1 : -1;
+            break;
+        }
+        offset += aligned;
+
+        if ((size_t)bytes != aligned) {
+            // Unaligned tail at the end of the file: finish it through the page cache
+            if (fcntl(dest_fd, F_SETFL, dest_flags) != 0
+                || pwrite_all(dest_fd, buffer + aligned, bytes - aligned, offset) != 0) {
+                result = -1;
+                break;
+            }
+            offset += bytes - aligned;
+            break;
         }
     }
 
-    closedir(dir); // Close the directory stream
-    random_delay();
-    fprintf(stderr, GRAY "   [INFO] Finished processing directory: %s\n" RESET, src);
+    int saved_errno = errno;
+    free(buffer);
+    fcntl(src_fd, F_SETFL, src_flags);
+    fcntl(dest_fd, F_SETFL, dest_flags);
+    errno = saved_errno;
+    if (result > 0) {
+        goto unsupported;
+    }
+    if (result == 0) {
+        if (caps) {
+            __atomic_store_n(&caps->direct, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&stats.direct_files, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.direct_bytes, offset, __ATOMIC_RELAXED);
+    }
+    return result;
+
+unsupported:
+    if (caps && __atomic_exchange_n(&caps->direct, 0, __ATOMIC_RELAXED) != 0) {
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] O_DIRECT not supported from device %u:%u to device %u:%u; using buffered I/O.\n" RESET,
+                major(src_stat->st_dev), minor(src_stat->st_dev), major(target_dev), minor(target_dev));
+    }
+    return 1;
 }
 
-// Handle errors and exit
-void handle_error(const char *msg) {
-    perror(msg); // Print the error message
-    random_delay();
-    fprintf(stderr, RED "[FATAL] Program terminating due to error: %s\n" RESET, msg);
+// Copy a large file as fixed-size ranges handed out to file_jobs threads
+// (this one included), each using copy_file_range() or pread()/pwrite() at
+// its own offsets, so fast sources and striped targets see several streams
+// at once. Returns 0 once every range is done, -1 on error (errno set), or 1
+// if no helper thread could be started.
+int copy_data_parallel(int src_fd, int dest_fd, const struct stat *src_stat) {
+    struct range_copy copy;
+    copy.src_fd = src_fd;
+    copy.dest_fd = dest_fd;
+    copy.size = src_stat->st_size;
+    copy.range_size = options.range_size;
+    copy.chunk = choose_buffer_size(src_stat);
+    copy.next_range = 0;
+    copy.error = 0;
+
+    long ranges = (copy.size + copy.range_size - 1) / copy.range_size;
+    int jobs = options.file_jobs < MAX_FILE_JOBS ? options.file_jobs : MAX_FILE_JOBS;
+    if (jobs > ranges) {
+        jobs = ranges;
+    }
+
+    pthread_t threads[MAX_FILE_JOBS];
+    int started = 0;
+    while (started < jobs - 1 && pthread_create(&threads[started], NULL, range_copy_worker, &copy) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        return 1;
+    }
+
+    range_copy_ranges(&copy); // This thread takes ranges too, keeping its own buffers for its next files
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (copy.error) {
+        errno = copy.error;
+        return -1;
+    }
+    __atomic_fetch_add(&stats.parallel_files, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Helper thread of copy_data_parallel(): copy ranges, then free the buffers
+// this short-lived thread allocated
+void *range_copy_worker(void *arg) {
+    range_copy_ranges(arg);
+    release_io_buffer();
+    return NULL;
+}
+
+// Take ranges of a file and copy them until none are left or one has failed
+void range_copy_ranges(struct range_copy *copy) {
+    for (;;) {
+        long index = __atomic_fetch_add(&copy->next_range, 1, __ATOMIC_RELAXED);
+        off_t offset = index * copy->range_size;
+        if (offset >= copy->size || __atomic_load_n(&copy->error, __ATOMIC_RELAXED)) {
+            break;
+        }
+        off_t len = copy->size - offset < copy->range_size ? copy->size - offset : copy->range_size;
+
+        // Each range drops its own pages in cache-neutral mode
+        struct cache_window window;
+        cache_window_start(&window, copy->src_fd, copy->dest_fd);
+        window.offset = window.src_dropped = window.dest_started = window.dest_dropped = offset;
+
+        if (copy_range(copy->src_fd, copy->dest_fd, offset, len, copy->chunk, &window) != 0) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&copy->error, &expected, errno, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+        cache_window_finish(&window);
+    }
+}
+
+// Copy a large file between two devices with a reader thread filling a ring
+// of buffers while this thread writes them out, so the source and the target
+// work at the same time instead of taking turns. Returns 0 on success, -1 on
+// error (errno set), or 1 if the pipeline couldn't be set up.
+int copy_data_pipelined(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    struct pipeline pipe;
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.src_fd = src_fd;
+    pipe.chunk = choose_buffer_size(src_stat);
+    pipe.depth = options.pipeline_depth < 2 ? 2 : options.pipeline_depth;
+    if (pipe.depth > MAX_PIPELINE_DEPTH) {
+        pipe.depth = MAX_PIPELINE_DEPTH;
+    }
+
+    pipe.buffers = calloc(pipe.depth, sizeof(*pipe.buffers));
+    pipe.lengths = calloc(pipe.depth, sizeof(*pipe.lengths));
+    int ready = pipe.buffers && pipe.lengths;
+    for (int i = 0; ready && i < pipe.depth; i++) {
+        ready = (pipe.buffers[i] = malloc(pipe.chunk)) != NULL;
+    }
+
+    pthread_t reader;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.filled, NULL);
+    pthread_cond_init(&pipe.drained, NULL);
+    int result = 1; // Fall back to another method if the thread can't start
+    if (ready && pthread_create(&reader, NULL, pipeline_reader, &pipe) == 0) {
+        off_t offset = 0;
+        result = 0;
+        for (;;) {
+            pthread_mutex_lock(&pipe.lock);
+            while (pipe.count == 0) {
+                pthread_cond_wait(&pipe.filled, &pipe.lock);
+            }
+            ssize_t len = pipe.lengths[pipe.tail];
+            pthread_mutex_unlock(&pipe.lock);
+
+            if (len <= 0) {
+                if (len < 0) {
+                    errno = pipe.read_error;
+                    result = -1;
+                }
+                break; // End of file or read error
+            }
+            if (pwrite_all(dest_fd, pipe.buffers[pipe.tail], len, offset) != 0) {
+                int saved_errno = errno;
+                pthread_mutex_lock(&pipe.lock);
+                pipe.stop = 1;
+                pthread_cond_signal(&pipe.drained);
+                pthread_mutex_unlock(&pipe.lock);
+                errno = saved_errno;
+                result = -1;
+                break;
+            }
+            offset += len;
+            cache_window_advance(window, offset);
+
+            pthread_mutex_lock(&pipe.lock);
+            pipe.tail = (pipe.tail + 1) % pipe.depth;
+            pipe.count--;
+            pthread_cond_signal(&pipe.drained);
+            pthread_mutex_unlock(&pipe.lock);
+        }
+        int saved_errno = errno;
+        pthread_join(reader, NULL);
+        errno = saved_errno;
+    }
+
+    pthread_cond_destroy(&pipe.drained);
+    pthread_cond_destroy(&pipe.filled);
+    pthread_mutex_destroy(&pipe.lock);
+    for (int i = 0; pipe.buffers && i < pipe.depth; i++) {
+        free(pipe.buffers[i]);
+    }
+    free(pipe.buffers);
+    free(pipe.lengths);
+    return result;
+}
+
+// Reader side of a pipelined copy: fill free buffers from the source until
+// the end of the file, a read error, or the writer asks it to stop
+void *pipeline_reader(void *arg) {
+    struct pipeline *pipe = arg;
+    off_t offset = 0;
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->count == pipe->depth && !pipe->stop) {
+            pthread_cond_wait(&pipe->drained, &pipe->lock);
+        }
+        if (pipe->stop) {
+            pthread_mutex_unlock(&pipe->lock);
+            return NULL;
+        }
+        int index = pipe->head;
+        pthread_mutex_unlock(&pipe->lock);
+
+        // Fill the whole buffer so the writer always gets full chunks
+        ssize_t len = 0;
+        while (len < (ssize_t)pipe->chunk) {
+            ssize_t bytes = pread(pipe->src_fd, pipe->buffers[index] + len, pipe->chunk - len, offset + len);
+            if (bytes == 0) {
+                break;
+            }
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                pipe->read_error = errno;
+                len = -1;
+                break;
+            }
+            len += bytes;
+        }
+        offset += len > 0 ? len : 0;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->lengths[index] = len;
+        pipe->head = (pipe->head + 1) % pipe->depth;
+        pipe->count++;
+        pthread_cond_signal(&pipe->filled);
+        pthread_mutex_unlock(&pipe->lock);
+        if (len <= 0) {
+            return NULL; // The writer stops at this buffer
+        }
+    }
+}
+
+// Copy file contents with the first strategy in the chain that works for
+// this device pair: the fastest one found by probing (or the one forced
+// with the strategy option) first, then the others in their usual order.
+// A strategy that reports it can't work here is skipped for the rest of the
+// run, and its partial progress is picked up by the next one. mmap is only
+// used when the strategy option asks for it.
+// Returns 0 on success, -1 on error (errno set), or COPY_SHORT if the source
+// ended before its size when opened (`window->offset` bytes were copied).
+int copy_data_chain(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window, int dest_dirfd) {
+    struct dev_caps *caps = get_dev_caps(src_stat->st_dev, target_dev);
+    if (caps && !__atomic_load_n(&caps->probed, __ATOMIC_ACQUIRE) && options.strategy == 0 && src_stat->st_size >= PROBE_MIN_SIZE) {
+        // Claim the probe under the lock but run it without, so other
+        // workers aren't held up; until it's published they copy in the
+        // default order. Even if probing fails, it isn't tried again.
+        pthread_mutex_lock(&caps_lock);
+        int claimed = !caps->probed; // Another worker may have claimed the pair first
+        __atomic_store_n(&caps->probed, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&caps_lock);
+        if (claimed) {
+            probe_copy_strategies(src_fd, src_stat, caps, dest_dirfd);
+        }
+    }
+
+    int preferred = -1;
+    if (options.strategy > 0) {
+        preferred = options.strategy - 1;
+    } else if (caps) {
+        preferred = __atomic_load_n(&caps->best, __ATOMIC_RELAXED);
+    }
+
+    for (int i = -1; i < STRATEGY_COUNT; i++) {
+        int strategy = i < 0 ? preferred : i;
+        if (strategy < 0 || (i >= 0 && strategy == preferred)) {
+            continue;
+        }
+        if (strategy == STRATEGY_MMAP && options.strategy != STRATEGY_MMAP + 1) {
+            continue; // Even if a saved probe from an older version picked it
+        }
+        if (caps && (__atomic_load_n(&caps->unsupported, __ATOMIC_RELAXED) & (1u << strategy))) {
+            continue;
+        }
+        int result = copy_strategies[strategy](src_fd, dest_fd, src_stat, window);
+        if (result == COPY_SHORT && strategy != STRATEGY_READ_WRITE) {
+            // copy_file_range() and sendfile() also copy nothing from files
+            // they can't handle (such as those in /proc); read() tells
+            // whether the source really ended
+            return copy_data_buffered(src_fd, dest_fd, src_stat, window);
+        }
+        if (result <= 0 || result == COPY_SHORT) {
+            return result;
+        }
+        if (caps) {
+            __atomic_fetch_or(&caps->unsupported, 1u << strategy, __ATOMIC_RELAXED);
+        }
+    }
+    errno = EOPNOTSUPP; // Not reached: read/write always works
+    return -1;
+}
+
+// Time every copy strategy on the first PROBE_BYTES of a source file, copying
+// into an unnamed temporary file in the destination directory, and remember which ones
+// work and which is fastest for this device pair. The source range is read
+// into the page cache first so the strategies are compared on equal terms.
+// mmap isn't timed, since it's never picked automatically.
+// Called by the worker that claimed the pair, without caps_lock; other
+// workers meanwhile copy in the default order.
+void probe_copy_strategies(int src_fd, const struct stat *src_stat, struct dev_caps *caps, int dest_dirfd) {
+    int probe_fd = openat(dest_dirfd, ".", O_TMPFILE | O_WRONLY, 0600);
+    if (probe_fd < 0) {
+        // Not every filesystem has O_TMPFILE; use a named file and unlink it right away
+        char name[64];
+        snprintf(name, sizeof(name), ".backup-probe-%ld", (long)getpid());
+        probe_fd = openat(dest_dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (probe_fd < 0) {
+            return;
+        }
+        unlinkat(dest_dirfd, name, 0);
+    }
+
+    struct stat probe_stat = *src_stat;
+    if (probe_stat.st_size > PROBE_BYTES) {
+        probe_stat.st_size = PROBE_BYTES;
+    }
+    readahead(src_fd, 0, probe_stat.st_size);
+
+    double rates[STRATEGY_COUNT] = { 0 };
+    int best = -1; // Published once all strategies are timed
+    for (int strategy = 0; strategy < STRATEGY_COUNT; strategy++) {
+        if (strategy == STRATEGY_MMAP) {
+            continue;
+        }
+        if (lseek(src_fd, 0, SEEK_SET) != 0 || ftruncate(probe_fd, 0) != 0 || lseek(probe_fd, 0, SEEK_SET) != 0) {
+            break;
+        }
+        struct cache_window window;
+        cache_window_start(&window, src_fd, probe_fd);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int result = copy_strategies[strategy](src_fd, probe_fd, &probe_stat, &window);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (result == 1) {
+            __atomic_fetch_or(&caps->unsupported, 1u << strategy, __ATOMIC_RELAXED);
+        } else if ((result == 0 || result == COPY_SHORT) && window.offset > 0) {
+            double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            rates[strategy] = window.offset / (seconds > 1e-9 ? seconds : 1e-9);
+            if (best < 0 || rates[strategy] > rates[best]) {
+                best = strategy;
+            }
+        }
+    }
+    pthread_mutex_lock(&caps_lock);
+    __atomic_store_n(&caps->best, best, __ATOMIC_RELAXED);
+    probe_results_changed = 1;
+    pthread_mutex_unlock(&caps_lock);
+    close(probe_fd);
+    lseek(src_fd, 0, SEEK_SET);
+
+    char summary[256] = "";
+    for (int strategy = 0; strategy < STRATEGY_COUNT; strategy++) {
+        size_t len = strlen(summary);
+        if (strategy == STRATEGY_MMAP) {
+            continue;
+        }
+        if (__atomic_load_n(&caps->unsupported, __ATOMIC_RELAXED) & (1u << strategy)) {
+            snprintf(summary + len, sizeof(summary) - len, " %s=unsupported", strategy_names[strategy + 1]);
+        } else {
+            snprintf(summary + len, sizeof(summary) - len, " %s=%.0fMiB/s", strategy_names[strategy + 1], rates[strategy] / (1024 * 1024));
+        }
+    }
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Probed copy strategies from device %u:%u to %u:%u:%s; using %s.\n" RESET,
+            major(caps->src_dev), minor(caps->src_dev), major(caps->dest_dev), minor(caps->dest_dev),
+            summary, best >= 0 ? strategy_names[best + 1] : "the default order");
+}
+
+// Strategy: copy_file_range(), so the data never leaves the kernel (and
+// filesystems that can share extents or offload the copy do so).
+// Returns 0 on success, -1 on error (errno set), COPY_SHORT if the source
+// ended early, or 1 if the kernel or this filesystem pair can't do it. In
+// that case both file offsets sit just past whatever was already copied, so
+// another strategy can carry on from there.
+int copy_data_kernel(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    while (window->offset < src_stat->st_size) {
+        off_t remaining = src_stat->st_size - window->offset;
+        size_t want = remaining < (off_t)cache_window_chunk() ? (size_t)remaining : cache_window_chunk();
+        struct timespec write_start;
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        ssize_t copied = copy_file_range(src_fd, NULL, dest_fd, NULL, want, 0);
+        record_write_latency(&write_start);
+        if (copied > 0) {
+            cache_window_advance(window, window->offset + copied);
+            continue;
+        }
+        if (copied == 0) {
+            return COPY_SHORT; // The source ended early (or can't be copied this way; see copy_data_chain())
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+            return 1; // Not possible between these two files
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Strategy: sendfile(), which moves data from the source's page cache into
+// the destination without a trip through user space.
+// Returns 0 on success, -1 on error (errno set), COPY_SHORT if the source
+// ended early, or 1 if unsupported here.
+int copy_data_sendfile(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    while (window->offset < src_stat->st_size) {
+        off_t remaining = src_stat->st_size - window->offset;
+        size_t want = remaining < (off_t)cache_window_chunk() ? (size_t)remaining : cache_window_chunk();
+        struct timespec write_start;
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        ssize_t sent = sendfile(dest_fd, src_fd, NULL, want);
+        record_write_latency(&write_start);
+        if (sent > 0) {
+            cache_window_advance(window, window->offset + sent);
+            continue;
+        }
+        if (sent == 0) {
+            return COPY_SHORT;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) {
+            return 1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Strategy: splice() the source into this thread's pipe and from the pipe
+// into the destination, moving page references instead of copying bytes
+// where the filesystems allow it.
+// Returns 0 on success, -1 on error (errno set), COPY_SHORT if the source
+// ended early, or 1 if unsupported here.
+int copy_data_splice(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    int *pipe_fds = get_splice_pipe();
+    if (!pipe_fds) {
+        return 1;
+    }
+
+    while (window->offset < src_stat->st_size) {
+        off_t remaining = src_stat->st_size - window->offset;
+        size_t want = remaining < (off_t)splice_pipe_size ? (size_t)remaining : (size_t)splice_pipe_size;
+        ssize_t in = splice(src_fd, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0) {
+            return COPY_SHORT;
+        }
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EINVAL || errno == ENOSYS ? 1 : -1;
+        }
+
+        ssize_t left = in;
+        while (left > 0) {
+            struct timespec write_start;
+            clock_gettime(CLOCK_MONOTONIC, &write_start);
+            ssize_t out = splice(pipe_fds[0], NULL, dest_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            record_write_latency(&write_start);
+            if (out > 0) {
+                left -= out;
+                continue;
+            }
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            // The destination won't take spliced data. Write out what is
+            // already in the pipe so the next strategy starts at the right place.
+            int saved_errno = out < 0 ? errno : EIO;
+            char *buffer = get_io_buffer(left);
+            ssize_t drained = 0;
+            while (buffer && drained < left) {
+                ssize_t bytes = read(pipe_fds[0], buffer + drained, left - drained);
+                if (bytes <= 0) {
+                    break;
+                }
+                drained += bytes;
+            }
+            if (!buffer || drained < left || pwrite_all(dest_fd, buffer, left, window->offset + (in - left)) != 0
+                || lseek(dest_fd, window->offset + in, SEEK_SET) < 0) {
+                return -1;
+            }
+            cache_window_advance(window, window->offset + in);
+            errno = saved_errno;
+            return saved_errno == EINVAL ? 1 : -1;
+        }
+        cache_window_advance(window, window->offset + in);
+    }
+    return 0;
+}
+
+// Strategy: map the source and write() straight from the mapping, which
+// saves the copy into a separate read buffer. A file truncated by someone
+// else while it's mapped would raise SIGBUS and end the whole backup, which
+// is why this is never picked by probing and only used when it's asked for.
+// Returns 0 on success, -1 on error (errno set), or 1 if the file can't be mapped.
+int copy_data_mmap(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    if ((unsigned long long)src_stat->st_size > SIZE_MAX) {
+        return 1; // Doesn't fit in the address space
+    }
+    size_t size = src_stat->st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, src_fd, 0);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    size_t chunk = choose_buffer_size(src_stat);
+    int result = 0;
+    while (window->offset < src_stat->st_size) {
+        size_t remaining = size - window->offset;
+        struct timespec write_start;
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        ssize_t written = write(dest_fd, map + window->offset, remaining < chunk ? remaining : chunk);
+        record_write_latency(&write_start);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        cache_window_advance(window, window->offset + written);
+    }
+
+    int saved_errno = errno;
+    munmap(map, size);
+    lseek(src_fd, window->offset, SEEK_SET); // Keep the source offset in step for any next strategy
+    errno = saved_errno;
+    return result;
+}
+
+// Strategy: read() into this thread's buffer and write() it out. Works
+// everywhere, so it ends every chain.
+// Returns 0 on success, -1 on error (errno set), or COPY_SHORT if the source
+// ended early.
+int copy_data_buffered(int src_fd, int dest_fd, const struct stat *src_stat, struct cache_window *window) {
+    size_t chunk = choose_buffer_size(src_stat);
+    char *buffer = get_io_buffer(chunk); // Buffer to temporarily store file data
+    if (!buffer) {
+        return -1;
+    }
+    while (window->offset < src_stat->st_size) {
+        off_t remaining = src_stat->st_size - window->offset;
+        ssize_t bytes = read(src_fd, buffer, remaining < (off_t)chunk ? (size_t)remaining : chunk); // Read data into the buffer
+        if (bytes == 0) {
+            return COPY_SHORT;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ssize_t written = 0;
+        while (written < bytes) { // Write buffer contents to destination, resuming after short writes
+            struct timespec write_start;
+            clock_gettime(CLOCK_MONOTONIC, &write_start);
+            ssize_t n = write(dest_fd, buffer + written, bytes - written);
+            record_write_latency(&write_start);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            written += n;
+        }
+        cache_window_advance(window, window->offset + bytes);
+    }
+    return 0;
+}
+
+// Copy `len` bytes starting at `offset` from one file to the same offset in
+// another, inside the kernel when possible and through a buffer otherwise.
+// File offsets are left untouched. Returns 0 on success or -1 on error (errno set).
+int copy_range(int src_fd, int dest_fd, off_t offset, off_t len, size_t chunk, struct cache_window *window) {
+    off_t end = offset + len;
+    while (offset < end) {
+        loff_t in = offset, out = offset;
+        size_t want = end - offset < (off_t)cache_window_chunk() ? (size_t)(end - offset) : cache_window_chunk();
+        struct timespec write_start;
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        ssize_t copied = copy_file_range(src_fd, &in, dest_fd, &out, want, 0);
+        record_write_latency(&write_start);
+        if (copied > 0) {
+            offset += copied;
+            if (window) {
+                cache_window_advance(window, offset);
+            }
+            continue;
+        }
+        if (copied == 0) {
+            return 0; // The source ended early
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        break; // Finish the range through a buffer
+    }
+
+    char *buffer = get_io_buffer(chunk);
+    if (!buffer) {
+        return -1;
+    }
+    while (offset < end) {
+        size_t want = end - offset < (off_t)chunk ? (size_t)(end - offset) : chunk;
+        ssize_t bytes = pread(src_fd, buffer, want, offset);
+        if (bytes == 0) {
+            break;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (pwrite_all(dest_fd, buffer, bytes, offset) != 0) {
+            return -1;
+        }
+        offset += bytes;
+        if (window) {
+            cache_window_advance(window, offset);
+        }
+    }
+    return 0;
+}
+
+// Pick how much data each read()/write() pair moves for a file. Unless a
+// fixed buffer_size is configured, the size class of the file sets a target
+// (small files need little, large media files want big sequential I/O),
+// which is kept within buffer_min..buffer_max, rounded to whole blocks of the
+// source and target filesystems and never made larger than the file itself.
+size_t choose_buffer_size(const struct stat *src_stat) {
+    unsigned long long block = src_stat->st_blksize > target_blksize ? src_stat->st_blksize : target_blksize;
+    if (block == 0 || block > MAX_BUFFER_SIZE) {
+        block = 4096;
+    }
+
+    unsigned long long size = options.buffer_size;
+    if (size == 0) {
+        off_t file_size = src_stat->st_size;
+        if (file_size < 1024 * 1024) {
+            size = options.buffer_min;
+        } else if (file_size < 64 * 1024 * 1024) {
+            size = 1024 * 1024;
+        } else if (file_size < 1024 * 1024 * 1024) {
+            size = 4 * 1024 * 1024;
+        } else {
+            size = options.buffer_max;
+        }
+        if (size < options.buffer_min) {
+            size = options.buffer_min;
+        }
+        if (size > options.buffer_max) {
+            size = options.buffer_max;
+        }
+        if (size > (unsigned long long)file_size) {
+            size = file_size; // No point in a buffer bigger than the file
+        }
+    }
+    if (size > MAX_BUFFER_SIZE) {
+        size = MAX_BUFFER_SIZE;
+    }
+
+    size = (size + block - 1) / block * block;
+    return size ? (size_t)size : (size_t)block;
+}
+
+// Return this thread's I/O buffer, grown to at least `size` bytes. The
+// buffer is kept for the thread's lifetime so files don't pay for an
+// allocation each; short-lived threads free it with release_io_buffer().
+// Returns NULL (errno set) if it can't be grown.
+char *get_io_buffer(size_t size) {
+    if (size > io_buffer_size) {
+        char *buffer = realloc(io_buffer, size);
+        if (!buffer) {
+            return NULL;
+        }
+        io_buffer = buffer;
+        io_buffer_size = size;
+    }
+    return io_buffer;
+}
+
+// Start tracking a copy. In cache-neutral mode the source is also marked as
+// read sequentially, so the kernel reads ahead and recycles pages early.
+void cache_window_start(struct cache_window *window, int src_fd, int dest_fd) {
+    memset(window, 0, sizeof(*window));
+    window->src_fd = src_fd;
+    window->dest_fd = dest_fd;
+    if (options.nocache) {
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+// Record that everything before `offset` has been copied. Once a full
+// window has been copied since the last step, the previous window of the
+// destination is waited on and writeback of the current one is started, so
+// the file never has more than about two windows of dirty pages. In
+// cache-neutral mode the copied source pages and the destination pages
+// that reached the disk are dropped as well.
+void cache_window_advance(struct cache_window *window, off_t offset) {
+    window->offset = offset;
+    off_t size = cache_window_size();
+    if (size == 0 || offset - window->dest_started < size) {
+        return;
+    }
+
+    if (options.nocache) {
+        posix_fadvise(window->src_fd, window->src_dropped, offset - window->src_dropped, POSIX_FADV_DONTNEED);
+        __atomic_fetch_add(&stats.cache_dropped_bytes, offset - window->src_dropped, __ATOMIC_RELAXED); // Range copies share the counter
+        window->src_dropped = offset;
+    }
+
+    if (window->dest_started > window->dest_dropped) {
+        off_t len = window->dest_started - window->dest_dropped;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sync_file_range(window->dest_fd, window->dest_dropped, len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (options.writeback_window > 0) {
+            __atomic_fetch_add(&stats.writeback_waits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats.writeback_wait_micros,
+                               (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000, __ATOMIC_RELAXED);
+        }
+        if (options.nocache) {
+            posix_fadvise(window->dest_fd, window->dest_dropped, len, POSIX_FADV_DONTNEED);
+            __atomic_fetch_add(&stats.cache_dropped_bytes, len, __ATOMIC_RELAXED);
+        }
+        window->dest_dropped = window->dest_started;
+    }
+
+    sync_file_range(window->dest_fd, window->dest_started, offset - window->dest_started, SYNC_FILE_RANGE_WRITE);
+    window->dest_started = offset;
+}
+
+// Write back and drop everything the copy still has cached
+void cache_window_finish(struct cache_window *window) {
+    if (!options.nocache) {
+        return;
+    }
+    posix_fadvise(window->src_fd, window->src_dropped, 0, POSIX_FADV_DONTNEED);
+    __atomic_fetch_add(&stats.cache_dropped_bytes, window->offset - window->src_dropped, __ATOMIC_RELAXED);
+
+    sync_file_range(window->dest_fd, window->dest_dropped, 0,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(window->dest_fd, window->dest_dropped, 0, POSIX_FADV_DONTNEED);
+    __atomic_fetch_add(&stats.cache_dropped_bytes, window->offset - window->dest_dropped, __ATOMIC_RELAXED);
+
+    window->src_dropped = window->dest_started = window->dest_dropped = window->offset;
+}
+
+// How much to copy with one copy_file_range() call: a window at a time in
+// the cache-neutral and smoothed writeback modes so they can act as we go,
+// otherwise up to 1 GiB
+size_t cache_window_chunk() {
+    off_t size = cache_window_size();
+    if (size > 0 && size < (1 << 30)) {
+        return size;
+    }
+    return 1 << 30;
+}
+
+// Bytes copied between two writeback steps: the cache window in cache-neutral
+// mode, the writeback window in smoothed writeback mode (the smaller of the
+// two if both are on), or 0 if neither is on
+off_t cache_window_size() {
+    off_t size = 0;
+    if (options.nocache && options.cache_window > 0) {
+        size = options.cache_window;
+    }
+    if (options.writeback_window > 0 && (size == 0 || (off_t)options.writeback_window < size)) {
+        size = options.writeback_window;
+    }
+    return size;
+}
+
+// Count a write (or in-kernel copy) call that started at `start` in the
+// write latency histogram
+void record_write_latency(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long micros = (end.tv_sec - start->tv_sec) * 1000000LL + (end.tv_nsec - start->tv_nsec) / 1000;
+    int bucket = 0;
+    while (micros >= 2 && bucket < WRITE_LATENCY_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    __atomic_fetch_add(&stats.write_latency[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Return this thread's pipe for the splice strategy, creating it (as large as
+// the system allows, up to SPLICE_PIPE_SIZE) on first use. Returns NULL if
+// no pipe can be created.
+int *get_splice_pipe() {
+    if (splice_pipe[0] < 0) {
+        if (pipe(splice_pipe) != 0) {
+            splice_pipe[0] = splice_pipe[1] = -1;
+            return NULL;
+        }
+        splice_pipe_size = fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        if (splice_pipe_size <= 0) {
+            splice_pipe_size = fcntl(splice_pipe[1], F_GETPIPE_SZ);
+        }
+        if (splice_pipe_size <= 0) {
+            splice_pipe_size = 64 * 1024; // The Linux default
+        }
+    }
+    return splice_pipe;
+}
+
+// Free this thread's I/O buffer, small-file arena, directory entry buffer and splice pipe
+void release_io_buffer() {
+    free(io_buffer);
+    io_buffer = NULL;
+    io_buffer_size = 0;
+    free(small_file_arena);
+    small_file_arena = NULL;
+    free(dirent_buffer);
+    dirent_buffer = NULL;
+    if (splice_pipe[0] >= 0) {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+
+// Write all of `buffer` at `offset`, resuming after short writes.
+// Returns 0 on success or -1 on error (errno set).
+int pwrite_all(int fd, const char *buffer, size_t len, off_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        struct timespec write_start;
+        clock_gettime(CLOCK_MONOTONIC, &write_start);
+        ssize_t n = pwrite(fd, buffer + written, len - written, offset + written);
+        record_write_latency(&write_start);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+// Set up the io_uring engine. If the kernel doesn't offer io_uring (too old,
+// disabled by sysctl or blocked by a seccomp filter), warn and switch back
+// to the synchronous engine.
+void uring_engine_init() {
+    unsigned depth = options.uring_depth;
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > URING_MAX_DEPTH) {
+        depth = URING_MAX_DEPTH;
+    }
+
+    struct uring_engine *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        handle_error(RED "Failed to allocate io_uring engine" RESET);
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, depth * 2, &params); // One read and one write per chunk
+    if (ring->ring_fd < 0) {
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] io_uring is unavailable (%s). Using the synchronous copy engine.\n" RESET, strerror(errno));
+        free(ring);
+        options.engine = ENGINE_SYNC;
+        return;
+    }
+
+    // Map the submission ring, the completion ring and the SQE array
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        handle_error(RED "Failed to map io_uring submission ring" RESET);
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            handle_error(RED "Failed to map io_uring completion ring" RESET);
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        handle_error(RED "Failed to map io_uring submission entries" RESET);
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // One chunk buffer per slot, registered so the kernel doesn't have to
+    // map them again for every request
+    ring->depth = depth;
+    unsigned long long chunk_size = options.buffer_size ? options.buffer_size : URING_CHUNK_SIZE;
+    if (chunk_size > MAX_BUFFER_SIZE / depth) {
+        chunk_size = MAX_BUFFER_SIZE / depth; // Keep the registered memory within reason (and the size within 32 bits)
+    }
+    ring->chunk_size = (chunk_size + 4095) / 4096 * 4096;
+    ring->buffers = aligned_alloc(4096, (size_t)depth * ring->chunk_size);
+    ring->slots = calloc(depth, sizeof(*ring->slots));
+    ring->free_slots = calloc(depth, sizeof(*ring->free_slots));
+    ring->files = calloc(depth, sizeof(*ring->files));
+    struct iovec *iovecs = calloc(depth, sizeof(*iovecs));
+    if (!ring->buffers || !ring->slots || !ring->free_slots || !ring->files || !iovecs) {
+        handle_error(RED "Failed to allocate io_uring buffers" RESET);
+    }
+    for (unsigned i = 0; i < depth; i++) {
+        iovecs[i].iov_base = ring->buffers + (size_t)i * ring->chunk_size;
+        iovecs[i].iov_len = ring->chunk_size;
+        ring->free_slots[ring->free_count++] = depth - 1 - i;
+    }
+    ring->fixed_buffers = syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, iovecs, depth) == 0;
+    if (!ring->fixed_buffers) {
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] Could not register io_uring buffers (%s). Using unregistered buffers.\n" RESET, strerror(errno));
+    }
+    free(iovecs);
+
+    uring = ring;
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] io_uring engine ready with %u chunks of %u KiB in flight.\n" RESET,
+            depth, ring->chunk_size / 1024);
+}
+
+// Hand an opened source/destination pair to the io_uring engine. The engine
+// owns both descriptors from here on and closes them, logs the result and
+// applies permissions once the last chunk has been written.
+void uring_copy_file(int src_fd, int dest_fd, const struct stat *src_stat, const char *src, const char *dest) {
+    if (src_stat->st_size == 0) {
+        finish_file_copy(dest_fd, src_stat->st_mode, src, dest);
+        close(src_fd);
+        durability_file_done(dest_fd, 0);
+        return;
+    }
+
+    // Make room for one more file if every file slot is taken
+    while (uring->file_count == (int)uring->depth) {
+        uring_reap(1);
+    }
+
+    struct uring_file *file = calloc(1, sizeof(*file));
+    if (!file || !(file->src = strdup(src)) || !(file->dest = strdup(dest))) {
+        handle_error(RED "Failed to allocate io_uring file state" RESET);
+    }
+    file->src_fd = src_fd;
+    file->dest_fd = dest_fd;
+    file->mode = src_stat->st_mode;
+    file->size = src_stat->st_size;
+    uring->files[uring->file_count++] = file;
+
+    uring_fill();
+    while (uring->free_count == 0) { // Keep the queue full, but don't run ahead of the traversal
+        uring_reap(1);
+        uring_fill();
+    }
+}
+
+// Queue read->write chunk pairs for the active files until every slot is in use
+void uring_fill() {
+    for (int i = 0; i < uring->file_count && uring->free_count > 0; i++) {
+        struct uring_file *file = uring->files[i];
+        while (!file->failed && file->next_offset < file->size && uring->free_count > 0) {
+            unsigned index = uring->free_slots[--uring->free_count];
+            struct uring_slot *slot = &uring->slots[index];
+            off_t remaining = file->size - file->next_offset;
+
+            slot->file = file;
+            slot->offset = file->next_offset;
+            slot->len = remaining < uring->chunk_size ? (unsigned)remaining : uring->chunk_size;
+            slot->pending = 2;
+            file->next_offset += slot->len;
+            file->inflight++;
+
+            // The write is linked to the read, so it starts only after the
+            // read has filled the buffer with exactly `len` bytes
+            uring_queue_rw(index, 0, IOSQE_IO_LINK);
+            uring_queue_rw(index, 1, 0);
+        }
+    }
+    if (uring->to_submit > 0) {
+        uring_enter(0);
+    }
+}
+
+// Fill in the next submission queue entry for the read (is_write = 0) or
+// write (is_write = 1) half of a slot
+void uring_queue_rw(unsigned index, int is_write, unsigned char flags) {
+    struct uring_slot *slot = &uring->slots[index];
+    unsigned tail = *uring->sq_tail + uring->to_submit;
+    struct io_uring_sqe *sqe = &uring->sqes[tail & uring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (uring->fixed_buffers) {
+        sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = index;
+    } else {
+        sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = is_write ? slot->file->dest_fd : slot->file->src_fd;
+    sqe->off = slot->offset;
+    sqe->addr = (unsigned long)(uring->buffers + (size_t)index * uring->chunk_size);
+    sqe->len = slot->len;
+    sqe->flags = flags;
+    sqe->user_data = ((unsigned long long)index << 1) | is_write;
+
+    uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+    uring->to_submit++;
+}
+
+// Publish queued entries and submit them, optionally waiting for completions
+void uring_enter(unsigned min_complete) {
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + uring->to_submit, __ATOMIC_RELEASE);
+    unsigned to_submit = uring->to_submit;
+    uring->to_submit = 0;
+
+    for (;;) {
+        int submitted = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, min_complete,
+                                min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            to_submit -= submitted;
+            if (to_submit == 0) {
+                return;
+            }
+            continue; // The kernel took only part of the batch
+        }
+        // The completion ring is twice the size of the submission ring, so it
+        // can't overflow; only interruptions are worth retrying
+        if (errno != EINTR && errno != EAGAIN) {
+            handle_error(RED "io_uring submission failed" RESET);
+        }
+    }
+}
+
+// Wait for at least `min_complete` completions and handle everything that is ready
+void uring_reap(unsigned min_complete) {
+    if (uring_process_completions() == 0 && min_complete > 0) {
+        uring_enter(min_complete);
+        uring_process_completions();
+    }
+}
+
+// Handle every completion currently in the completion ring.
+// Returns the number of completions handled.
+int uring_process_completions() {
+    int handled = 0;
+    unsigned head = *uring->cq_head;
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+        unsigned index = cqe->user_data >> 1;
+        struct uring_slot *slot = &uring->slots[index];
+        if (cqe->user_data & 1) {
+            slot->write_res = cqe->res;
+        } else {
+            slot->read_res = cqe->res;
+        }
+        head++;
+        handled++;
+        if (--slot->pending == 0) {
+            uring_complete_slot(index);
+        }
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return handled;
+}
+
+// Both halves of a chunk are done: check the results, finish the chunk by
+// hand after a short read or write, and finish the file if it was its last
+void uring_complete_slot(unsigned index) {
+    struct uring_slot *slot = &uring->slots[index];
+    struct uring_file *file = slot->file;
+
+    if (slot->read_res < 0) {
+        file->failed = file->failed ? file->failed : -slot->read_res;
+    } else if (slot->write_res < 0 && slot->write_res != -ECANCELED) {
+        file->failed = file->failed ? file->failed : -slot->write_res;
+    } else if (slot->read_res != (int)slot->len || slot->write_res != (int)slot->len) {
+        // A short read cancels the linked write, so redo the rest of the
+        // chunk synchronously with the same buffer
+        char *buffer = uring->buffers + (size_t)index * uring->chunk_size;
+        off_t done = slot->write_res > 0 ? slot->write_res : 0;
+        while (done < slot->len) {
+            ssize_t bytes = pread(file->src_fd, buffer, slot->len - done, slot->offset + done);
+            if (bytes == 0) {
+                break; // The source shrank while we were copying it
+            }
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0 || pwrite_all(file->dest_fd, buffer, bytes, slot->offset + done) != 0) {
+                file->failed = file->failed ? file->failed : errno;
+                break;
+            }
+            done += bytes;
+        }
+    }
+
+    if (options.nocache && !file->failed) {
+        // Chunks finish out of order, so drop each one on its own and
+        // start its writeback; the rest is waited on when the file is done
+        posix_fadvise(file->src_fd, slot->offset, slot->len, POSIX_FADV_DONTNEED);
+        sync_file_range(file->dest_fd, slot->offset, slot->len, SYNC_FILE_RANGE_WRITE);
+        stats.cache_dropped_bytes += slot->len;
+    }
+
+    slot->file = NULL;
+    uring->free_slots[uring->free_count++] = index;
+    file->inflight--;
+    if (file->inflight == 0 && (file->failed || file->next_offset >= file->size)) {
+        uring_finish_file(file);
+    }
+}
+
+// Close a file the engine is done with and report how it went
+void uring_finish_file(struct uring_file *file) {
+    for (int i = 0; i < uring->file_count; i++) {
+        if (uring->files[i] == file) {
+            uring->files[i] = uring->files[--uring->file_count];
+            break;
+        }
+    }
+
+    if (options.nocache && !file->failed) {
+        sync_file_range(file->dest_fd, 0, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file->dest_fd, 0, 0, POSIX_FADV_DONTNEED);
+        stats.cache_dropped_bytes += file->size;
+    }
+    if (file->failed) {
+        errno = file->failed;
+        perror(RED "Failed to write to destination file" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Write error occurred while copying file: %s -> %s\n" RESET, file->src, file->dest);
+    }
+    finish_file_copy(file->dest_fd, file->mode, file->src, file->dest);
+    close(file->src_fd);
+    durability_file_done(file->dest_fd, file->size);
+
+    free(file->src);
+    free(file->dest);
+    free(file);
+}
+
+// Wait for every file still in flight and tear the io_uring engine down
+void uring_engine_finish() {
+    if (!uring) {
+        return;
+    }
+    while (uring->file_count > 0) {
+        uring_reap(1);
+        uring_fill();
+    }
+
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->ring_fd);
+    free(uring->buffers);
+    free(uring->slots);
+    free(uring->free_slots);
+    free(uring->files);
+    free(uring);
+    uring = NULL;
+}
+
+// Copy the directory `src` to the backup directory `dest`, which main() has
+// just created (in stream mode `dest` is the directory's name in the archive
+// instead). Several jobs walk the tree in parallel, except when streaming or
+// with the io_uring engine, which each need the files one at a time.
+// Subdirectories are created as they're found, or all before any file is
+// copied by the skeleton phase of the largest-first schedule.
+void copy_directory(const char *src, const char *dest) {
+    if (options.jobs > 1 && stream_fd < 0 && !uring) {
+        walk_copy_tree(src, dest);
+        return;
+    }
+    if (options.jobs > 1) {
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] %s one file at a time; walking the tree on one thread.\n" RESET,
+                stream_fd >= 0 ? "The stream takes" : "The io_uring engine queues");
+    }
+    copy_directory_serial(src, dest);
+}
+
+// Copy the contents of `src` to the existing directory `dest` on this thread.
+// Every lookup is relative to directory descriptors, so its cost doesn't grow
+// with the depth of the tree, and trees deeper than PATH_MAX can be copied.
+// Instead of recursing, the levels being copied are kept on a stack of
+// frames, and the source and destination paths (used in messages, and in
+// stream mode as names in the archive) are built up in two shared buffers.
+// Memory then grows with the length of the current path and the size of the
+// listings on it, and the call stack doesn't grow with depth at all.
+void copy_directory_serial(const char *src, const char *dest) {
+    struct path_buffer src_path = { 0 }, dest_path = { 0 };
+    path_push(&src_path, src);
+    path_push(&dest_path, dest);
+
+    struct copy_frame *top = copy_frame_enter(NULL, src, dest, &src_path, &dest_path);
+    while (top) {
+        if (top->next == top->listing.count) {
+            // Every entry of this level is done; go back up to its parent
+            if (top->has_stat) {
+                finish_directory(dir_node_fd(&top->dest), top->dir_stat.st_mode, &top->dir_stat.st_mtim, dest_path.data);
+            }
+            if (options.durability == DURABILITY_BATCH && stream_fd < 0) {
+                durability_sync_directory(dir_node_fd(&top->dest), dest_path.data); // fdatasync() of the files doesn't cover their names
+            }
+            random_delay();
+            fprintf(stderr, GRAY "   [INFO] Finished processing directory: %s\n" RESET, src_path.data);
+            struct copy_frame *up = top->up;
+            copy_frame_leave(top);
+            top = up;
+            if (top) {
+                path_truncate(&src_path, top->src_len);
+                path_truncate(&dest_path, top->dest_len);
+            }
+            continue;
+        }
+
+        struct dir_entry *entry = &top->listing.entries[top->next++];
+        const char *name = top->listing.names + entry->name;
+        path_push(&src_path, name);     // Full source path, for messages
+        path_push(&dest_path, name);    // Full destination path, for messages and the archive
+
+        // Reopening one side may take many opens on a deep tree; the other
+        // side stays pinned so they don't evict it
+        int src_dirfd = dir_node_fd(&top->src);
+        top->src.pinned++;
+        int dest_dirfd = stream_fd >= 0 ? -1 : dir_node_fd(&top->dest);
+        top->src.pinned--;
+
+        mode_t type;
+        if (src_dirfd >= 0 && classify_entry(src_dirfd, name, entry->type, &type) == 0) {
+            if (S_ISDIR(type)) { // Check if the entry is a directory
+                random_delay();
+                fprintf(stderr, GRAY "   [INFO] Found directory: %s\n" RESET, src_path.data);
+                if (stream_fd < 0 && mkdirat(dest_dirfd, name, 0755) != 0 && errno != EEXIST) {
+                    perror(RED "Failed to create destination directory" RESET);
+                    random_delay();
+                    fprintf(stderr, RED "   [ERROR] Could not create destination directory: %s\n" RESET, dest_path.data);
+                } else {
+                    struct copy_frame *child = copy_frame_enter(top, name, name, &src_path, &dest_path);
+                    if (child) {
+                        top = child; // Its entries come next; the paths now end in its name
+                        continue;
+                    }
+                }
+            } else if (S_ISREG(type)) { // Check if the entry is a regular file
+                random_delay();
+                fprintf(stderr, GRAY "   [INFO] Found file: %s\n" RESET, src_path.data);
+                if (stream_fd >= 0) {
+                    stream_file(src_dirfd, name, src_path.data, dest_path.data);
+                } else {
+                    copy_file_at(src_dirfd, dest_dirfd, name, src_path.data, dest_path.data); // Copy the file
+                }
+            } else {
+                random_delay();
+                fprintf(stderr, YELLOW "   [WARNING] Skipped unknown entry type: %s\n" RESET, src_path.data);
+            }
+        } else {
+            perror("Failed to retrieve file metadata");
+            random_delay();
+            fprintf(stderr, YELLOW "   [WARNING] Could not stat entry: %s\n" RESET, src_path.data);
+        }
+        path_truncate(&src_path, top->src_len);
+        path_truncate(&dest_path, top->dest_len);
+    }
+    free(src_path.data);
+    free(dest_path.data);
+}
+
+// Start copying a directory whose destination already exists: open it
+// relative to the level `up` (NULL at the top of the tree, where the names
+// are paths), read its listing, and add it to the stream when streaming.
+// The paths already end in the directory's name. Returns the new level, or
+// NULL (after reporting why) if the directory can't be read.
+struct copy_frame *copy_frame_enter(struct copy_frame *up, const char *src_name, const char *dest_name,
+                                    struct path_buffer *src_path, struct path_buffer *dest_path) {
+    struct copy_frame *frame = calloc(1, sizeof(*frame));
+    if (!frame) {
+        handle_error("Failed to allocate directory level");
+    }
+    frame->up = up;
+    frame->src = (struct dir_node){ .parent = up ? &up->src : NULL, .name = src_name, .fd = -1 };
+    frame->dest = (struct dir_node){ .parent = up ? &up->dest : NULL, .name = dest_name, .fd = -1 };
+    frame->src_len = src_path->len;
+    frame->dest_len = dest_path->len;
+
+    // Read the whole listing first, so no directory has to stay open for
+    // reading at every level of the tree while subdirectories are copied
+    int src_dirfd = dir_node_fd(&frame->src);
+    if (src_dirfd < 0 || read_dir_listing(src_dirfd, &frame->listing) != 0) {
+        perror(RED "Failed to open source directory" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not open directory: %s\n" RESET, src_path->data);
+        dir_node_close(&frame->src);
+        free(frame);
+        return NULL;
+    }
+    fprintf(stderr, GRAY "   [INFO] Opened source directory: %s\n" RESET, src_path->data);
+    order_dir_listing(src_dirfd, &frame->listing);
+
+    // One lookup gives the mount for the cross-mount check and the metadata
+    // to give the destination (or, when streaming, the tar header fields)
+    if (stat_directory(&frame->src, src_dirfd, src_path->data, stream_fd >= 0 ? STAT_STREAM_MASK : STAT_DIR_MASK, &frame->dir_stat) != 0) {
+        perror(RED "Failed to retrieve directory metadata" RESET);
+    } else if (stream_fd >= 0) {
+        stream_directory(&frame->dir_stat, dest_path->data);
+    } else {
+        frame->has_stat = 1;
+    }
+    random_delay();
+    fprintf(stderr, GRAY "   [INFO] Destination directory created or already exists: %s\n" RESET, dest_path->data);
+    return frame;
+}
+
+// Close and free a finished level of the single-threaded traversal
+void copy_frame_leave(struct copy_frame *frame) {
+    dir_node_close(&frame->src);
+    dir_node_close(&frame->dest);
+    free_dir_listing(&frame->listing);
+    free(frame);
+}
+
+// Append "/name" to a path (just `name` if the path is empty), growing the
+// buffer as needed
+void path_push(struct path_buffer *path, const char *name) {
+    size_t name_len = strlen(name);
+    size_t len = path->len + (path->len > 0) + name_len;
+    if (len + 1 > path->size) {
+        size_t size = path->size ? path->size : 256;
+        while (len + 1 > size) {
+            size *= 2;
+        }
+        char *grown = realloc(path->data, size);
+        if (!grown) {
+            handle_error("Failed to allocate path");
+        }
+        path->data = grown;
+        path->size = size;
+    }
+    if (path->len > 0) {
+        path->data[path->len++] = '/';
+    }
+    memcpy(path->data + path->len, name, name_len + 1);
+    path->len = len;
+}
+
+// Cut a path back to its first `len` bytes
+void path_truncate(struct path_buffer *path, size_t len) {
+    path->len = len;
+    path->data[len] = '\0';
+}
+
+// Give a destination directory whose contents are all written the source
+// directory's permissions and modification time. Only done at the end, since
+// creating entries changes the time and a read-only mode would stop them
+// from being created.
+void finish_directory(int dest_dirfd, mode_t mode, const struct timespec *mtime, const char *dest) {
+    struct timespec times[2] = { { .tv_sec = 0, .tv_nsec = UTIME_OMIT }, *mtime };
+    if (dest_dirfd < 0 || fchmod(dest_dirfd, mode & 07777) != 0 || futimens(dest_dirfd, times) != 0) {
+        perror(RED "Failed to set directory metadata" RESET);
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] Permissions or modification time not set for directory: %s\n" RESET, dest);
+        __atomic_fetch_add(&stats.dir_metadata_errors, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Look up a source directory that was just opened, remember which mount it
+// is on, and warn if that isn't its parent's. `mask` asks for whatever else
+// the caller needs in `dir_stat`. Returns 0 on success or -1 (errno set).
+int stat_directory(struct dir_node *src_dir, int src_dirfd, const char *src, unsigned int mask, struct stat *dir_stat) {
+    struct stat_extra dir_extra;
+    if (stat_at(src_dirfd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, mask, dir_stat, &dir_extra) != 0) {
+        return -1;
+    }
+    if (dir_extra.has_mnt_id) {
+        src_dir->mnt_id = dir_extra.mnt_id;
+    }
+    if (src_dir->parent && src_dir->parent->mnt_id && src_dir->mnt_id && src_dir->mnt_id != src_dir->parent->mnt_id) {
+        random_delay();
+        fprintf(stderr, YELLOW "   [WARNING] Directory is on a different mount than its parent: %s\n" RESET, src);
+        __atomic_fetch_add(&stats.mounts_crossed, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Tell directories from regular files by the entry type from the listing;
+// the rest of the metadata comes from fstat() on the open file. Only
+// filesystems that don't fill in d_type, and symbolic links (which are
+// followed), need a separate lookup. Stores the S_IFMT bits of the entry in
+// `type` (0 for devices, sockets and FIFOs, which aren't copied).
+// Returns 0 on success or -1 (errno set) if the lookup failed.
+int classify_entry(int dirfd, const char *name, unsigned char d_type, mode_t *type) {
+    if (d_type == DT_DIR) {
+        *type = S_IFDIR;
+    } else if (d_type == DT_REG) {
+        *type = S_IFREG;
+    } else if (d_type != DT_UNKNOWN && d_type != DT_LNK) {
+        *type = 0;
+    } else {
+        struct stat entry_stat;
+        if (stat_at(dirfd, name, AT_STATX_DONT_SYNC, STAT_TYPE_MASK, &entry_stat, NULL) != 0) {
+            return -1;
+        }
+        *type = entry_stat.st_mode & S_IFMT;
+    }
+    return 0;
+}
+
+// Copy the contents of `src` to the existing directory `dest` with
+// options.jobs workers. Each worker lists directories and copies files from
+// its own deque of tasks, pushing the subdirectories and files it finds, and
+// steals from the others when its deque runs dry. A file is copied by
+// whichever worker gets to it first, so a large directory is spread over
+// all of them while its listing is still being handled.
+void walk_copy_tree(const char *src, const char *dest) {
+    struct walk_pool pool = { .workers = options.jobs };
+    pool.deques = calloc(pool.workers, sizeof(*pool.deques));
+    if (!pool.deques) {
+        handle_error("Failed to allocate traversal queues");
+    }
+    for (int i = 0; i < pool.workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wakeup, NULL);
+    walk = &pool;
+
+    struct walk_dir *root = walk_dir_new(NULL, "");
+    root->src.name = src;   // At the top of the tree the names are paths
+    root->dest.name = dest;
+    walk_push(0, root, NULL);
+
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Walking the tree with %d workers.\n" RESET, pool.workers);
+    struct timespec walk_start, walk_end;
+    clock_gettime(CLOCK_MONOTONIC, &walk_start);
+    if (options.schedule != SCHEDULE_LARGEST) {
+        walk_run(walk_worker);
+    } else {
+        // Pre-scan: list the whole tree, collecting its directories and
+        // files, then create the directories. Then copy the files largest
+        // first, so the biggest ones don't start last and leave one worker
+        // busy while the others idle; the small files fill in around them
+        // at the end.
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pool.found = calloc(pool.workers, sizeof(*pool.found));
+        if (!pool.found) {
+            handle_error("Failed to allocate file lists");
+        }
+        walk_run(walk_worker);
+
+        size_t dir_count = 0;
+        for (int i = 0; i < pool.workers; i++) {
+            pool.schedule_count += pool.found[i].file_count;
+            dir_count += pool.found[i].dir_count;
+        }
+        pool.schedule = malloc((pool.schedule_count ? pool.schedule_count : 1) * sizeof(*pool.schedule));
+        struct walk_dir **dirs = malloc((dir_count ? dir_count : 1) * sizeof(*dirs));
+        if (!pool.schedule || !dirs) {
+            handle_error("Failed to allocate file schedule");
+        }
+        size_t file_count = 0;
+        dir_count = 0;
+        for (int i = 0; i < pool.workers; i++) {
+            // A worker that found nothing has NULL lists, which memcpy() mustn't see
+            if (pool.found[i].file_count > 0) {
+                memcpy(pool.schedule + file_count, pool.found[i].files, pool.found[i].file_count * sizeof(*pool.schedule));
+                file_count += pool.found[i].file_count;
+            }
+            if (pool.found[i].dir_count > 0) {
+                memcpy(dirs + dir_count, pool.found[i].dirs, pool.found[i].dir_count * sizeof(*dirs));
+                dir_count += pool.found[i].dir_count;
+            }
+            free(pool.found[i].files);
+            free(pool.found[i].dirs);
+        }
+        free(pool.found);
+        pool.found = NULL;
+        qsort(pool.schedule, pool.schedule_count, sizeof(*pool.schedule), compare_walk_files);
+        for (size_t i = 0; i < pool.schedule_count; i++) {
+            stats.scheduled_bytes += pool.schedule[i].size;
+        }
+        stats.scheduled_files = pool.schedule_count;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats.prescan_micros = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+
+        // Skeleton: the whole destination tree exists before the first file
+        // is copied, so copying never waits on or races for a mkdir
+        walk_build_skeleton(dirs, dir_count);
+        for (size_t i = 0; i < dir_count; i++) {
+            walk_dir_put(dirs[i]); // Finishes the empty ones right away
+        }
+        free(dirs);
+
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] Pre-scan found %zu files; copying them largest first.\n" RESET, pool.schedule_count);
+        walk_run(walk_schedule_worker);
+        free(pool.schedule);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &walk_end);
+    stats.walk_micros = (walk_end.tv_sec - walk_start.tv_sec) * 1000000ULL + (walk_end.tv_nsec - walk_start.tv_nsec) / 1000;
+
+    walk = NULL;
+    worker_stats = NULL; // This thread was worker 0
+    for (int i = 0; i < pool.workers; i++) {
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    pthread_cond_destroy(&pool.wakeup);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+// Run `worker` on options.jobs threads, this one being worker 0, and wait
+// for all of them. Each gets its index as its argument; if a thread can't be
+// created, the indexes stay contiguous, so workers 0 to the returned count
+// minus one are the ones that ran (and own those slots of walk_worker_stats).
+int walk_run(void *(*worker)(void *)) {
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    for (int i = 1; i < walk->workers; i++) {
+        if (pthread_create(&threads[started], NULL, worker, (void *)(long)(started + 1)) == 0) {
+            started++;
+        }
+    }
+    worker((void *)0L); // Worker 0 holds the first task
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (started + 1 > stats.walk_workers) {
+        stats.walk_workers = started + 1; // The report covers every slot any phase used
+    }
+    return started + 1;
+}
+
+// Copy the files of the largest-first schedule, taking the largest one not
+// yet taken each time, until none are left
+void *walk_schedule_worker(void *arg) {
+    worker_stats = &walk_worker_stats[(long)arg];
+    for (;;) {
+        size_t next = __atomic_fetch_add(&walk->schedule_next, 1, __ATOMIC_RELAXED);
+        if (next >= walk->schedule_count) {
+            break;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        walk_copy_file(walk->schedule[next].dir, walk->schedule[next].name);
+        walk_worker_busy(&start);
+        __atomic_fetch_add(&stats.walk_tasks, 1, __ATOMIC_RELAXED);
+    }
+    release_io_buffer();
+    return NULL;
+}
+
+// Create on the target every directory found by the pre-scan. A directory
+// needs its parent, so they are created one depth at a time, starting at the
+// top: all directories of a depth at once by every worker (or by this
+// thread alone when there are only a few), each with mkdirat() relative to
+// its parent. Directories of the same parent are next to each other, so
+// workers share the parent's descriptor.
+void walk_build_skeleton(struct walk_dir **dirs, size_t count) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    qsort(dirs, count, sizeof(*dirs), compare_walk_dirs);
+    for (size_t first = 0; first < count;) {
+        size_t last = first;
+        while (last < count && dirs[last]->depth == dirs[first]->depth) {
+            last++;
+        }
+        walk->skeleton = dirs + first;
+        walk->skeleton_count = last - first;
+        walk->skeleton_next = 0;
+        if (walk->skeleton_count < 2 * (size_t)walk->workers) {
+            walk_skeleton_worker((void *)0L); // Not worth waking the workers for
+        } else {
+            walk_run(walk_skeleton_worker);
+        }
+        first = last;
+    }
+    walk->skeleton = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.skeleton_dirs = count;
+    stats.skeleton_micros = (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000;
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Created %zu directories on the target.\n" RESET, count);
+}
+
+// Create directories of the depth the skeleton phase is at until none are left
+void *walk_skeleton_worker(void *arg) {
+    worker_stats = &walk_worker_stats[(long)arg];
+    for (;;) {
+        size_t next = __atomic_fetch_add(&walk->skeleton_next, 1, __ATOMIC_RELAXED);
+        if (next >= walk->skeleton_count) {
+            break;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        walk_make_directory(walk->skeleton[next]);
+        walk_worker_busy(&start);
+    }
+    return NULL;
+}
+
+// Create one directory of the skeleton in its parent's destination. If the
+// parent couldn't be created, neither can it, and that was reported already.
+void walk_make_directory(struct walk_dir *dir) {
+    if (dir->parent->failed) {
+        dir->failed = 1;
+        return;
+    }
+    int parent_fd = dir_node_acquire(&dir->parent->dest);
+    if (parent_fd < 0 || mkdirat(parent_fd, dir->name, 0755) != 0) {
+        perror(RED "Failed to create destination directory" RESET);
+        char *dest_path = walk_dir_path(dir, 1, NULL);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not create destination directory: %s\n" RESET, dest_path);
+        free(dest_path);
+        dir->failed = 1;
+    }
+    if (parent_fd >= 0) {
+        dir_node_release(&dir->parent->dest);
+    }
+}
+
+// Add the time since `start` to the busy time of the worker on this thread
+void walk_worker_busy(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    worker_stats->busy_micros += (end.tv_sec - start->tv_sec) * 1000000ULL + (end.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Order two directories by depth, then by parent
+int compare_walk_dirs(const void *a, const void *b) {
+    const struct walk_dir *x = *(struct walk_dir *const *)a, *y = *(struct walk_dir *const *)b;
+    if (x->depth != y->depth) {
+        return x->depth < y->depth ? -1 : 1;
+    }
+    return x->parent < y->parent ? -1 : x->parent > y->parent;
+}
+
+// Order two scheduled files largest first
+int compare_walk_files(const void *a, const void *b) {
+    const struct walk_file *x = a, *y = b;
+    return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+// Run traversal tasks until the whole tree is done. `arg` is the worker's
+// index, which picks its deque.
+void *walk_worker(void *arg) {
+    int self = (int)(long)arg;
+    worker_stats = &walk_worker_stats[self];
+    struct walk_task task;
+    while (walk_next_task(self, &task)) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (task.name) {
+            walk_copy_file(task.dir, task.name);
+        } else {
+            walk_list_directory(self, task.dir);
+        }
+        walk_worker_busy(&start);
+        __atomic_fetch_add(&stats.walk_tasks, 1, __ATOMIC_RELAXED);
+
+        // The task's own subtasks were queued before this, so none are left
+        // only once every task is done
+        if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&walk->lock);
+            pthread_cond_broadcast(&walk->wakeup);
+            pthread_mutex_unlock(&walk->lock);
+        }
+    }
+    release_io_buffer();
+    return NULL;
+}
+
+// Take the next task for worker `self`: the newest one of its own deque, or
+// else the oldest one of another worker's, sleeping while there is nothing
+// to take. Returns 1 with the task in `task`, or 0 once the traversal is over.
+int walk_next_task(int self, struct walk_task *task) {
+    for (;;) {
+        for (int i = 0; i < walk->workers; i++) {
+            struct walk_deque *deque = &walk->deques[(self + i) % walk->workers];
+            pthread_mutex_lock(&deque->lock);
+            int found = deque->head < deque->tail;
+            if (found) {
+                *task = i == 0 ? deque->tasks[--deque->tail] : deque->tasks[deque->head++];
+                __atomic_sub_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            }
+            pthread_mutex_unlock(&deque->lock);
+            if (found) {
+                if (i > 0) {
+                    __atomic_fetch_add(&stats.walk_steals, 1, __ATOMIC_RELAXED);
+                }
+                return 1;
+            }
+        }
+
+        // Sleep until a task is queued or the last one is done. Counting
+        // ourselves as a sleeper before checking `queued` means a worker that
+        // queues a task after the check sees us and wakes us up.
+        pthread_mutex_lock(&walk->lock);
+        __atomic_add_fetch(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0
+               && __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&walk->wakeup, &walk->lock);
+        }
+        __atomic_sub_fetch(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+        int over = __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&walk->lock);
+        if (over) {
+            return 0;
+        }
+    }
+}
+
+// Queue a task on worker `self`'s deque: listing `dir` if `name` is NULL,
+// otherwise copying the file `name` (a heap string the task takes over) from it
+void walk_push(int self, struct walk_dir *dir, char *name) {
+    __atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+
+    struct walk_deque *deque = &walk->deques[self];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        if (deque->head > 0) { // Reuse the room left by stolen tasks
+            memmove(deque->tasks, deque->tasks + deque->head, (deque->tail - deque->head) * sizeof(*deque->tasks));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->capacity) {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 256;
+            void *grown = realloc(deque->tasks, deque->capacity * sizeof(*deque->tasks));
+            if (!grown) {
+                handle_error("Failed to allocate traversal queue");
+            }
+            deque->tasks = grown;
+        }
+    }
+    deque->tasks[deque->tail++] = (struct walk_task){ .dir = dir, .name = name };
+    __atomic_add_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&deque->lock);
+
+    if (__atomic_load_n(&walk->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&walk->lock);
+        pthread_cond_signal(&walk->wakeup);
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+// List a directory for the parallel traversal: create its subdirectories on
+// the target and queue them, then queue its files. The files end up newest
+// in the deque, so this worker copies them while idle workers steal the
+// subdirectories and walk further down the tree.
+void walk_list_directory(int self, struct walk_dir *dir) {
+    char *dir_src_path = walk_dir_path(dir, 0, NULL);
+    int src_dirfd = dir_node_acquire(&dir->src);
+    struct dir_listing listing;
+    if (src_dirfd < 0 || read_dir_listing(src_dirfd, &listing) != 0) {
+        perror(RED "Failed to open source directory" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not open directory: %s\n" RESET, dir_src_path);
+        if (src_dirfd >= 0) {
+            dir_node_release(&dir->src);
+        }
+        free(dir_src_path);
+        walk_dir_put(dir);
+        return;
+    }
+    fprintf(stderr, GRAY "   [INFO] Opened source directory: %s\n" RESET, dir_src_path);
+    order_dir_listing(src_dirfd, &listing);
+    struct stat dir_stat;
+    if (stat_directory(&dir->src, src_dirfd, dir_src_path, STAT_DIR_MASK, &dir_stat) != 0) {
+        perror(RED "Failed to retrieve directory metadata" RESET);
+    } else {
+        dir->mode = dir_stat.st_mode;
+        dir->mtime = dir_stat.st_mtim;
+        dir->has_stat = 1;
+    }
+    // While pre-scanning nothing is created yet; that's the skeleton phase's job
+    int dest_dirfd = walk->found ? -1 : dir_node_acquire(&dir->dest);
+
+    // Subdirectories first, remembering which entries are files
+    for (size_t i = 0; i < listing.count; i++) {
+        const char *name = listing.names + listing.entries[i].name;
+        mode_t type;
+        int classified = classify_entry(src_dirfd, name, listing.entries[i].type, &type) == 0;
+        listing.entries[i].type = classified && S_ISREG(type) ? DT_REG : DT_UNKNOWN;
+        if (classified && S_ISREG(type)) {
+            continue;
+        }
+
+        char *src_path = path_join(dir_src_path, name);
+        if (!classified) {
+            perror("Failed to retrieve file metadata");
+            random_delay();
+            fprintf(stderr, YELLOW "   [WARNING] Could not stat entry: %s\n" RESET, src_path);
+            free(src_path);
+            continue;
+        }
+        if (!S_ISDIR(type)) {
+            random_delay();
+            fprintf(stderr, YELLOW "   [WARNING] Skipped unknown entry type: %s\n" RESET, src_path);
+            free(src_path);
+            continue;
+        }
+        random_delay();
+        fprintf(stderr, GRAY "   [INFO] Found directory: %s\n" RESET, src_path);
+        if (walk->found) {
+            struct walk_found *found = &walk->found[self];
+            if (found->dir_count == found->dir_capacity) {
+                found->dir_capacity = found->dir_capacity ? found->dir_capacity * 2 : 64;
+                void *grown = realloc(found->dirs, found->dir_capacity * sizeof(*found->dirs));
+                if (!grown) {
+                    handle_error("Failed to allocate directory list");
+                }
+                found->dirs = grown;
+            }
+            // The list holds a reference too, so that a directory can't be
+            // finished and freed before the skeleton phase has created it
+            struct walk_dir *child = walk_dir_new(dir, name);
+            __atomic_add_fetch(&child->refs, 1, __ATOMIC_RELAXED);
+            found->dirs[found->dir_count++] = child;
+            walk_push(self, child, NULL);
+        } else if (dest_dirfd < 0 || (mkdirat(dest_dirfd, name, 0755) != 0 && errno != EEXIST)) {
+            perror(RED "Failed to create destination directory" RESET);
+            char *dest_path = walk_dir_path(dir, 1, name);
+            random_delay();
+            fprintf(stderr, RED "   [ERROR] Could not create destination directory: %s\n" RESET, dest_path);
+            free(dest_path);
+        } else {
+            walk_push(self, walk_dir_new(dir, name), NULL);
+        }
+        free(src_path);
+    }
+
+    // Queued last to first, so this worker, taking the newest task each
+    // time, copies them in the listing's order. While pre-scanning they are
+    // only collected, with their sizes, for the largest-first schedule.
+    for (size_t i = listing.count; i-- > 0;) {
+        if (listing.entries[i].type != DT_REG) {
+            continue;
+        }
+        char *name = strdup(listing.names + listing.entries[i].name);
+        if (!name) {
+            handle_error("Failed to allocate file name");
+        }
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+        if (!walk->found) {
+            walk_push(self, dir, name);
+            continue;
+        }
+
+        struct walk_found *found = &walk->found[self];
+        if (found->file_count == found->file_capacity) {
+            found->file_capacity = found->file_capacity ? found->file_capacity * 2 : 256;
+            void *grown = realloc(found->files, found->file_capacity * sizeof(*found->files));
+            if (!grown) {
+                handle_error("Failed to allocate file list");
+            }
+            found->files = grown;
+        }
+        struct stat file_stat;
+        if (stat_at(src_dirfd, name, AT_STATX_DONT_SYNC, STATX_SIZE, &file_stat, NULL) != 0) {
+            file_stat.st_size = 0; // Copying it will report what is wrong
+        }
+        found->files[found->file_count++] = (struct walk_file){ .dir = dir, .name = name, .size = file_stat.st_size };
+    }
+
+    free_dir_listing(&listing);
+    free(dir_src_path);
+    dir_node_release(&dir->src);
+    if (dest_dirfd >= 0) {
+        dir_node_release(&dir->dest);
+    }
+    walk_dir_put(dir);
+}
+
+// Copy the file `name` of a directory for the parallel traversal, then free
+// the name and drop the task's reference to the directory
+void walk_copy_file(struct walk_dir *dir, char *name) {
+    char *src_path = walk_dir_path(dir, 0, name);
+    char *dest_path = walk_dir_path(dir, 1, name);
+    random_delay();
+    fprintf(stderr, GRAY "   [INFO] Found file: %s\n" RESET, src_path);
+
+    int src_dirfd = dir_node_acquire(&dir->src);
+    int dest_dirfd = src_dirfd >= 0 ? dir_node_acquire(&dir->dest) : -1;
+    if (dest_dirfd >= 0) {
+        copy_file_at(src_dirfd, dest_dirfd, name, src_path, dest_path);
+        dir_node_release(&dir->dest);
+    } else {
+        perror(RED "Failed to open directory" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not copy file: %s\n" RESET, src_path);
+    }
+    if (src_dirfd >= 0) {
+        dir_node_release(&dir->src);
+    }
+
+    free(src_path);
+    free(dest_path);
+    free(name);
+    walk_dir_put(dir);
+}
+
+// Create the traversal state of the directory `name` in `parent`, holding
+// one reference for its listing and taking one on `parent`. At the top of
+// the tree (`parent` NULL) the caller sets the nodes' names to the paths.
+struct walk_dir *walk_dir_new(struct walk_dir *parent, const char *name) {
+    struct walk_dir *dir = calloc(1, sizeof(*dir) + strlen(name) + 1);
+    if (!dir) {
+        handle_error("Failed to allocate directory");
+    }
+    strcpy(dir->name, name);
+    dir->src = (struct dir_node){ .parent = parent ? &parent->src : NULL, .name = dir->name, .fd = -1 };
+    dir->dest = (struct dir_node){ .parent = parent ? &parent->dest : NULL, .name = dir->name, .fd = -1 };
+    dir->parent = parent;
+    dir->refs = 1;
+    if (parent) {
+        dir->depth = parent->depth + 1;
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    }
+    return dir;
+}
+
+// Build the full source (or, if `dest` is set, destination) path of the
+// entry `name` in a directory of the parallel traversal, or of the directory
+// itself if `name` is NULL, as a new heap string. Directories only keep
+// their own name, so memory doesn't grow with depth times path length; the
+// path is put together from the names up to the top of the tree when a
+// message needs it.
+char *walk_dir_path(const struct walk_dir *dir, int dest, const char *name) {
+    size_t len = name ? strlen(name) + 1 : 0;
+    for (const struct walk_dir *d = dir; d; d = d->parent) {
+        len += strlen(dest ? d->dest.name : d->src.name) + 1;
+    }
+    char *path = malloc(len);
+    if (!path) {
+        handle_error("Failed to allocate path");
+    }
+
+    // Fill it in from the end, one name and separator at a time
+    char *end = path + len - 1;
+    *end = '\0';
+    if (name) {
+        end -= strlen(name);
+        memcpy(end, name, strlen(name));
+    }
+    for (const struct walk_dir *d = dir; d; d = d->parent) {
+        const char *part = dest ? d->dest.name : d->src.name;
+        if (end != path + len - 1) {
+            *--end = '/';
+        }
+        end -= strlen(part);
+        memcpy(end, part, strlen(part));
+    }
+    return path;
+}
+
+// Drop a reference to a directory of the parallel traversal. The last one
+// finishes it, once everything inside it is done: its destination gets the
+// source's permissions and modification time and is flushed under the batch
+// durability policy, and its parent loses a reference in turn. Directories
+// are therefore finished deepest first, in a final pass up each branch.
+void walk_dir_put(struct walk_dir *dir) {
+    while (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (!dir->failed && (dir->has_stat || options.durability == DURABILITY_BATCH)) {
+            char *dest_path = walk_dir_path(dir, 1, NULL);
+            int dest_dirfd = dir_node_acquire(&dir->dest);
+            if (dir->has_stat) {
+                finish_directory(dest_dirfd, dir->mode, &dir->mtime, dest_path);
+            }
+            if (options.durability == DURABILITY_BATCH) {
+                durability_sync_directory(dest_dirfd, dest_path);
+            }
+            if (dest_dirfd >= 0) {
+                dir_node_release(&dir->dest);
+            }
+            free(dest_path);
+        }
+        char *src_path = walk_dir_path(dir, 0, NULL);
+        random_delay();
+        fprintf(stderr, GRAY "   [INFO] Finished processing directory: %s\n" RESET, src_path);
+        free(src_path);
+
+        struct walk_dir *parent = dir->parent;
+        dir_node_close(&dir->src);
+        dir_node_close(&dir->dest);
+        free(dir);
+        dir = parent;
+    }
+}
+
+// Return a directory's descriptor, reopening it relative to its parent if it
+// was closed to stay within MAX_OPEN_DIRS. Returns -1 if it can't be opened.
+// Only for the single-threaded traversal: nothing stops another thread from
+// closing the descriptor unless it is pinned (see dir_node_acquire()).
+int dir_node_fd(struct dir_node *node) {
+    pthread_mutex_lock(&dir_lock);
+    int fd = dir_node_open(node);
+    pthread_mutex_unlock(&dir_lock);
+    return fd;
+}
+
+// Return a directory's descriptor and pin it, so it stays open until the
+// matching dir_node_release(). Returns -1 (nothing pinned) if it can't be opened.
+int dir_node_acquire(struct dir_node *node) {
+    pthread_mutex_lock(&dir_lock);
+    int fd = dir_node_open(node);
+    if (fd >= 0) {
+        node->pinned++;
+    }
+    pthread_mutex_unlock(&dir_lock);
+    return fd;
+}
+
+// Unpin a descriptor returned by dir_node_acquire()
+void dir_node_release(struct dir_node *node) {
+    pthread_mutex_lock(&dir_lock);
+    node->pinned--;
+    pthread_mutex_unlock(&dir_lock);
+}
+
+// dir_node_fd() with dir_lock already held. A closed directory whose
+// ancestors were closed too is reached by reopening them from the nearest
+// open one down, in a loop, so even a chain thousands of levels long
+// doesn't deepen the call stack.
+int dir_node_open(struct dir_node *node) {
+    node->last_used = ++dir_clock;
+    if (node->fd >= 0) {
+        return node->fd;
+    }
+
+    // Collect the closed directories from `node` up to the nearest open one
+    struct dir_node *short_chain[16];
+    struct dir_node **chain = short_chain;
+    size_t closed = 0;
+    for (struct dir_node *n = node; n && n->fd < 0; n = n->parent) {
+        closed++;
+    }
+    if (closed > sizeof(short_chain) / sizeof(short_chain[0]) && !(chain = malloc(closed * sizeof(*chain)))) {
+        return -1;
+    }
+    size_t i = 0;
+    for (struct dir_node *n = node; n && n->fd < 0; n = n->parent) {
+        chain[i++] = n;
+    }
+
+    while (i-- > 0) {
+        struct dir_node *n = chain[i];
+        int parent_fd = AT_FDCWD;
+        if (n->parent) {
+            n->parent->last_used = ++dir_clock;
+            parent_fd = n->parent->fd;
+        }
+        n->last_used = ++dir_clock;
+        n->fd = openat(parent_fd, n->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (n->fd < 0) {
+            break;
+        }
+        open_dirs[open_dir_count++] = n;
+
+        // Close the least recently used other directory if that's one too
+        // many. The parent was just used, so it is never the one picked. If
+        // every other one is pinned, go over the limit until some are released.
+        if (open_dir_count > MAX_OPEN_DIRS) {
+            int oldest = -1;
+            for (int j = 0; j < open_dir_count; j++) {
+                if (open_dirs[j] != n && !open_dirs[j]->pinned
+                    && (oldest < 0 || open_dirs[j]->last_used < open_dirs[oldest]->last_used)) {
+                    oldest = j;
+                }
+            }
+            if (oldest >= 0) {
+                close(open_dirs[oldest]->fd);
+                open_dirs[oldest]->fd = -1;
+                open_dirs[oldest] = open_dirs[--open_dir_count];
+            }
+        }
+    }
+    if (chain != short_chain) {
+        int saved_errno = errno;
+        free(chain);
+        errno = saved_errno;
+    }
+    return node->fd;
+}
+
+// Close a directory's descriptor (if open) before the node goes away
+void dir_node_close(struct dir_node *node) {
+    pthread_mutex_lock(&dir_lock);
+    if (node->fd >= 0) {
+        for (int i = 0; i < open_dir_count; i++) {
+            if (open_dirs[i] == node) {
+                open_dirs[i] = open_dirs[--open_dir_count];
+                break;
+            }
+        }
+        close(node->fd);
+        node->fd = -1;
+    }
+    pthread_mutex_unlock(&dir_lock);
+}
+
+// Fill in `st` for `name` relative to `dirfd` (or for `dirfd` itself with
+// AT_EMPTY_PATH), asking statx() only for the STATX_* fields in `mask` so
+// the filesystem can skip the rest. Fields not asked for are left zero,
+// except the device and preferred I/O size, which always come back. If
+// `extra` isn't NULL, the creation time and mount ID are collected too where
+// the filesystem has them. `flags` may include AT_STATX_DONT_SYNC where a
+// cached answer will do. Falls back to fstatat() on kernels without statx().
+// Returns 0 on success or -1 (errno set).
+int stat_at(int dirfd, const char *name, int flags, unsigned int mask, struct stat *st, struct stat_extra *extra) {
+    static int no_statx = 0; // Set once statx() turns out to be missing (by any thread)
+    if (extra) {
+        memset(extra, 0, sizeof(*extra));
+    }
+    if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+        struct statx stx;
+        if (statx(dirfd, name, flags, mask | (extra ? STATX_BTIME | STATX_MNT_ID : 0), &stx) == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_blksize = stx.stx_blksize;
+            st->st_mode = stx.stx_mode & ((stx.stx_mask & STATX_TYPE ? S_IFMT : 0) | (stx.stx_mask & STATX_MODE ? 07777 : 0));
+            st->st_ino = stx.stx_mask & STATX_INO ? stx.stx_ino : 0;
+            st->st_uid = stx.stx_mask & STATX_UID ? stx.stx_uid : 0;
+            st->st_gid = stx.stx_mask & STATX_GID ? stx.stx_gid : 0;
+            st->st_size = stx.stx_mask & STATX_SIZE ? (off_t)stx.stx_size : 0;
+            st->st_blocks = stx.stx_mask & STATX_BLOCKS ? (blkcnt_t)stx.stx_blocks : 0;
+            if (stx.stx_mask & STATX_MTIME) {
+                st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+                st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            }
+            if (extra && (stx.stx_mask & STATX_BTIME)) {
+                extra->btime.tv_sec = stx.stx_btime.tv_sec;
+                extra->btime.tv_nsec = stx.stx_btime.tv_nsec;
+                extra->has_btime = 1;
+            }
+            if (extra && (stx.stx_mask & STATX_MNT_ID)) {
+                extra->mnt_id = stx.stx_mnt_id;
+                extra->has_mnt_id = 1;
+            }
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        __atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+    }
+    return fstatat(dirfd, name, st, flags & ~AT_STATX_SYNC_TYPE);
+}
+
+// Read every entry of the directory `dir_fd` (except "." and "..") into
+// `listing`, calling getdents64() with this thread's large buffer so even
+// directories with hundreds of thousands of entries take only a few calls.
+// Returns 0 on success or -1 (errno set).
+int read_dir_listing(int dir_fd, struct dir_listing *listing) {
+    memset(listing, 0, sizeof(*listing));
+    if (!dirent_buffer && !(dirent_buffer = malloc(DIRENT_BUFFER_SIZE))) {
+        return -1;
+    }
+    if (lseek(dir_fd, 0, SEEK_SET) != 0) { // The descriptor may have been listed before
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t bytes = getdents64(dir_fd, dirent_buffer, DIRENT_BUFFER_SIZE);
+        if (bytes == 0) {
+            return 0;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int saved_errno = errno;
+            free_dir_listing(listing);
+            errno = saved_errno;
+            return -1;
+        }
+
+        for (ssize_t pos = 0; pos < bytes;) {
+            struct dirent64 *entry = (struct dirent64 *)(dirent_buffer + pos);
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue; // Skip current and parent directory entries
+            }
+
+            size_t len = strlen(entry->d_name) + 1;
+            if (listing->count == listing->capacity) {
+                listing->capacity = listing->capacity ? listing->capacity * 2 : 64;
+                void *grown = realloc(listing->entries, listing->capacity * sizeof(*listing->entries));
+                if (!grown) {
+                    handle_error("Failed to allocate directory listing");
+                }
+                listing->entries = grown;
+            }
+            if (listing->names_len + len > listing->names_size) {
+                listing->names_size = listing->names_size ? listing->names_size * 2 : 4096;
+                while (listing->names_len + len > listing->names_size) {
+                    listing->names_size *= 2;
+                }
+                char *grown = realloc(listing->names, listing->names_size);
+                if (!grown) {
+                    handle_error("Failed to allocate directory listing");
+                }
+                listing->names = grown;
+            }
+            listing->entries[listing->count].name = listing->names_len;
+            listing->entries[listing->count].type = entry->d_type;
+            listing->entries[listing->count].ino = entry->d_ino;
+            listing->count++;
+            memcpy(listing->names + listing->names_len, entry->d_name, len);
+            listing->names_len += len;
+        }
+    }
+}
+
+// Free the memory of a directory listing
+void free_dir_listing(struct dir_listing *listing) {
+    free(listing->entries);
+    free(listing->names);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// Sort a directory listing as the order option asks, so a disk head reading
+// the files moves forward instead of back and forth. Inode numbers come
+// with the listing. Extent order takes an open and a FIEMAP lookup per
+// regular file and puts the files before the other entries; on a
+// filesystem without FIEMAP it falls back to inode order for the rest of the run.
+void order_dir_listing(int dir_fd, struct dir_listing *listing) {
+    static int no_fiemap = 0; // Set once FIEMAP turns out to be unsupported (by any thread)
+    if (options.order != ORDER_INODE && options.order != ORDER_EXTENT) {
+        return;
+    }
+    if (listing->count < 2) {
+        return; // Nothing to order (and an empty listing has no entries array)
+    }
+
+    for (size_t i = 0; i < listing->count; i++) {
+        listing->entries[i].key = listing->entries[i].ino;
+    }
+    unsigned long located = 0;
+    if (options.order == ORDER_EXTENT && !__atomic_load_n(&no_fiemap, __ATOMIC_RELAXED)) {
+        for (size_t i = 0; i < listing->count; i++) {
+            struct dir_entry *entry = &listing->entries[i];
+            if (entry->type != DT_REG) {
+                entry->key = ULLONG_MAX; // Directories and the rest after the files
+            } else if (first_extent(dir_fd, listing->names + entry->name, &entry->key) == 0) {
+                located++;
+            } else if (errno == EOPNOTSUPP || errno == ENOTTY) {
+                if (!__atomic_exchange_n(&no_fiemap, 1, __ATOMIC_RELAXED)) {
+                    random_delay();
+                    fprintf(stderr, YELLOW "   [WARNING] The source filesystem can't report extents; ordering files by inode instead.\n" RESET);
+                }
+                for (size_t j = 0; j < listing->count; j++) {
+                    listing->entries[j].key = listing->entries[j].ino;
+                }
+                located = 0;
+                break;
+            }
+            // Otherwise the file vanished or can't be read; copying it will report why
+        }
+    }
+
+    qsort(listing->entries, listing->count, sizeof(*listing->entries), compare_dir_entries);
+    __atomic_fetch_add(&stats.ordered_dirs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.extent_files, located, __ATOMIC_RELAXED);
+}
+
+// Order two listing entries by sort key, then by inode number
+int compare_dir_entries(const void *a, const void *b) {
+    const struct dir_entry *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+// Find the physical address of the first data extent of the regular file
+// `name` in `dir_fd`. A file without data (empty, or stored inline) gets 0,
+// so it sorts first. Returns 0 on success or -1 (errno set).
+int first_extent(int dir_fd, const char *name, unsigned long long *physical) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int result = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+    int saved_errno = errno;
+    close(fd);
+    if (result != 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    *physical = request.map.fm_mapped_extents > 0 ? request.extent.fe_physical : 0;
+    return 0;
+}
+
+// Whether sysfs says the block device `dev` is rotational. A partition has
+// no queue of its own, so the disk holding it is asked instead. Devices
+// sysfs doesn't know (network and virtual filesystems) count as not rotational.
+int device_is_rotational(dev_t dev) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        file = fopen(path, "r");
+    }
+    if (!file) {
+        return 0;
+    }
+    int rotational = fgetc(file) == '1';
+    fclose(file);
+    return rotational;
+}
+
+// Join a directory path and an entry name into a new heap string. Only used
+// for messages and archive names, so it may be longer than PATH_MAX.
+char *path_join(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+        handle_error("Failed to allocate path");
+    }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+// Open the sink named by the stream option: "-" for standard output, the
+// path of a listening Unix socket, or any other path (a FIFO, a device or a
+// regular file) to open for writing. Picks how file data will be moved to it.
+void stream_open(const char *sink) {
+    if (strcmp(sink, "-") == 0) {
+        // Messages meant for standard output go to standard error from now
+        // on, so they don't end up inside the archive
+        stream_fd = dup(STDOUT_FILENO);
+        if (stream_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            handle_error("Failed to set up standard output for streaming");
+        }
+    } else {
+        struct stat sink_stat;
+        if (stat(sink, &sink_stat) == 0 && S_ISSOCK(sink_stat.st_mode)) {
+            struct sockaddr_un address = { .sun_family = AF_UNIX };
+            if (strlen(sink) >= sizeof(address.sun_path)) {
+                errno = ENAMETOOLONG;
+                handle_error("Failed to connect to stream socket");
+            }
+            strcpy(address.sun_path, sink);
+            stream_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (stream_fd < 0 || connect(stream_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+                handle_error("Failed to connect to stream socket");
+            }
+        } else {
+            stream_fd = open(sink, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (stream_fd < 0) {
+                handle_error("Failed to open stream destination");
+            }
+        }
+    }
+    signal(SIGPIPE, SIG_IGN); // A reader that goes away shows up as EPIPE instead of killing us
+
+    struct stat sink_stat;
+    if (!options.zerocopy || fstat(stream_fd, &sink_stat) != 0) {
+        stream_method = STREAM_READ_WRITE;
+    } else if (S_ISFIFO(sink_stat.st_mode)) {
+        stream_method = STREAM_SPLICE; // Pages go from the page cache straight into the pipe
+    } else {
+        stream_method = STREAM_SENDFILE; // Sockets, devices and regular files
+    }
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Streaming to %s with %s.\n" RESET, sink, stream_method_names[stream_method]);
+    clock_gettime(CLOCK_MONOTONIC, &stream_started);
+}
+
+// Write the end-of-archive marker and close the sink
+void stream_close() {
+    // Two zero blocks end the archive; pad to a whole 10 KiB record like tar does
+    static const char zeros[TAR_RECORD_SIZE];
+    off_t end = stream_offset + 2 * TAR_BLOCK_SIZE;
+    end += (TAR_RECORD_SIZE - end % TAR_RECORD_SIZE) % TAR_RECORD_SIZE;
+    while (stream_offset < end) {
+        off_t left = end - stream_offset;
+        stream_write(zeros, left < TAR_RECORD_SIZE ? (size_t)left : TAR_RECORD_SIZE);
+    }
+    struct stat sink_stat;
+    if (options.durability != DURABILITY_NONE && fstat(stream_fd, &sink_stat) == 0 && S_ISREG(sink_stat.st_mode)
+        && fsync(stream_fd) != 0) {
+        handle_error("Failed to flush stream destination"); // An archive file is only done once it's on disk
+    }
+    if (close(stream_fd) != 0) {
+        handle_error("Failed to close stream destination");
+    }
+    stream_fd = -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats.stream_seconds = (now.tv_sec - stream_started.tv_sec) + (now.tv_nsec - stream_started.tv_nsec) / 1e9;
+}
+
+// Write a whole buffer to the sink. Any failure ends the run, since the
+// archive can't be repaired once a write has gone missing.
+void stream_write(const void *buffer, size_t len) {
+    const char *data = buffer;
+    while (len > 0) {
+        ssize_t written = write(stream_fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            handle_error("Failed to write to stream");
+        }
+        data += written;
+        len -= written;
+        stream_offset += written;
+    }
+}
+
+// Store a number as a zero-padded octal field of a tar header. Returns -1
+// if it doesn't fit.
+static int tar_octal(char *field, size_t size, unsigned long long value) {
+    if (snprintf(field, size, "%0*llo", (int)size - 1, value) >= (int)size) {
+        memset(field, '0', size - 1);
+        return -1;
+    }
+    return 0;
+}
+
+// Append one "LENGTH key=value\n" record to a pax extended header, where
+// LENGTH counts the whole record including its own digits
+static void pax_record(FILE *out, const char *key, const char *value) {
+    size_t total = strlen(key) + strlen(value) + 4; // Space, '=', newline and at least one digit
+    for (size_t limit = 10; total >= limit; limit *= 10) {
+        total++; // One more digit in the length
+    }
+    fprintf(out, "%zu %s=%s\n", total, key, value);
+}
+
+// Write the tar header of one archive member, preceded by a pax extended
+// header when its name or size don't fit in the ustar fields
+void stream_header(const char *name, const struct stat *st, char type) {
+    char header[TAR_BLOCK_SIZE];
+    memset(header, 0, sizeof(header));
+
+    // ustar splits long names at a '/' into a 155-byte prefix and a 100-byte name
+    size_t name_len = strlen(name);
+    const char *split = NULL;
+    if (name_len > 100) {
+        for (const char *slash = strchr(name, '/'); slash; slash = strchr(slash + 1, '/')) {
+            if ((size_t)(slash - name) <= 155 && name_len - (slash - name) - 1 <= 100 && slash[1] != '\0') {
+                split = slash;
+                break;
+            }
+        }
+    }
+
+    char *pax = NULL; // Names can be longer than PATH_MAX, so the pax header grows as needed
+    size_t pax_len = 0;
+    FILE *pax_out = open_memstream(&pax, &pax_len);
+    if (!pax_out) {
+        handle_error("Failed to build tar header");
+    }
+    if (name_len > 100 && !split) {
+        pax_record(pax_out, "path", name);
+    }
+    off_t size = type == '5' ? 0 : st->st_size; // Directories have no data
+    if (tar_octal(header + 124, 12, size) != 0) {
+        char size_text[32];
+        snprintf(size_text, sizeof(size_text), "%lld", (long long)size);
+        pax_record(pax_out, "size", size_text);
+    }
+    fclose(pax_out);
+    if (pax_len > 0) {
+        struct stat pax_stat = { .st_mode = 0644, .st_size = pax_len, .st_mtime = st->st_mtime };
+        stream_header("././@PaxHeader", &pax_stat, 'x');
+        stream_write(pax, pax_len);
+        stream_pad(pax_len);
+    }
+    free(pax);
+
+    if (split) {
+        memcpy(header + 345, name, split - name);            // prefix
+        memcpy(header, split + 1, name_len - (split - name) - 1); // name
+    } else {
+        memcpy(header, name, name_len < 100 ? name_len : 100); // Truncated if the pax header has the full name
+    }
+    tar_octal(header + 100, 8, st->st_mode & 07777);
+    tar_octal(header + 108, 8, st->st_uid);
+    tar_octal(header + 116, 8, st->st_gid);
+    tar_octal(header + 136, 12, st->st_mtime < 0 ? 0 : st->st_mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6); // magic, with its terminating NUL
+    memcpy(header + 263, "00", 2);    // version
+
+    // The checksum is computed with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(header); i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum); // Six digits, NUL, and the space already there
+    stream_write(header, sizeof(header));
+}
+
+// Pad the member just written to a whole number of tar blocks
+void stream_pad(off_t len) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    size_t padding = (TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    stream_write(zeros, padding);
+}
+
+// Move up to `len` bytes of a file, starting at `*offset`, to the sink with
+// the current stream method. Advances `*offset` and returns the number of
+// bytes moved, 0 at the end of the file, or -1 on error (errno set).
+ssize_t stream_data(int src_fd, off_t *offset, size_t len) {
+    ssize_t moved;
+    if (stream_method == STREAM_SPLICE) {
+        moved = splice(src_fd, offset, stream_fd, NULL, len, SPLICE_F_MORE);
+    } else if (stream_method == STREAM_SENDFILE) {
+        moved = sendfile(stream_fd, src_fd, offset, len);
+    } else {
+        char *buffer = get_io_buffer(STREAM_CHUNK_SIZE);
+        moved = buffer ? pread(src_fd, buffer, len, *offset) : -1;
+        if (moved > 0) {
+            stream_write(buffer, moved);
+            *offset += moved;
+        }
+        return moved;
+    }
+    if (moved > 0) {
+        stream_offset += moved;
+    }
+    return moved;
+}
+
+// Add a directory to the stream. `name` is its path inside the archive.
+void stream_directory(const struct stat *dir_stat, const char *name) {
+    char *dir_name = path_join(name, ""); // Directory names end with a slash in tar
+    stream_header(dir_name, dir_stat, '5');
+    free(dir_name);
+}
+
+// Add the file `src_name` of the directory `src_dirfd` to the stream. `src`
+// is its full path, for messages, and `name` its path inside the archive.
+// The data goes from the page cache to the sink without passing through
+// user space unless the zerocopy option is off or the sink can't take it.
+void stream_file(int src_dirfd, const char *src_name, const char *src, const char *name) {
+    int src_fd = openat(src_dirfd, src_name, O_RDONLY);
+    struct stat src_stat;
+    if (src_fd < 0 || stat_at(src_fd, "", AT_EMPTY_PATH, STAT_STREAM_MASK, &src_stat, NULL) != 0) {
+        perror(RED "Failed to open source file" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not open source file: %s\n" RESET, src);
+        if (src_fd >= 0) {
+            close(src_fd);
+        }
+        return;
+    }
+    if (options.nocache) {
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // The header promises st_size bytes, so that is exactly what gets sent
+    stream_header(name, &src_stat, '0');
+    off_t offset = 0;
+    while (offset < src_stat.st_size) {
+        off_t remaining = src_stat.st_size - offset;
+        size_t want = remaining < STREAM_CHUNK_SIZE ? (size_t)remaining : STREAM_CHUNK_SIZE;
+        ssize_t moved = stream_data(src_fd, &offset, want);
+        if (moved > 0) {
+            stats.stream_bytes += moved;
+            continue;
+        }
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0 && stream_method != STREAM_READ_WRITE && (errno == EINVAL || errno == ENOSYS)) {
+            // This source or sink can't do zero-copy; finish the run the plain way
+            random_delay();
+            fprintf(stderr, YELLOW "   [WARNING] %s not possible for %s; streaming through a buffer instead.\n" RESET,
+                    stream_method_names[stream_method], src);
+            stream_method = STREAM_READ_WRITE;
+            continue;
+        }
+        if (moved < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+            handle_error("Stream reader went away");
+        }
+
+        // The file shrank or can't be read; keep the archive valid with zeros
+        perror(RED "Failed to read source file" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Source file ended early or could not be read, padding with zeros: %s\n" RESET, src);
+        static const char zeros[TAR_BLOCK_SIZE];
+        while (offset < src_stat.st_size) {
+            size_t len = src_stat.st_size - offset < TAR_BLOCK_SIZE ? (size_t)(src_stat.st_size - offset) : TAR_BLOCK_SIZE;
+            stream_write(zeros, len);
+            offset += len;
+        }
+    }
+    stream_pad(src_stat.st_size);
+    if (options.nocache) {
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(src_fd);
+    stats.stream_files++;
+
+    random_delay();
+    fprintf(stderr, GRAY "   [INFO] File streamed: %s -> %s\n" RESET, src, name);
+}
+
+// Take over a finished destination file's descriptor. With the batch
+// durability policy the file joins the current batch, which is flushed once
+// it holds sync_batch_files files or sync_batch_bytes bytes; otherwise the
+// descriptor is simply closed. If batches already hold every descriptor the
+// open file limit leaves them, the file is flushed on its own instead.
+void durability_file_done(int dest_fd, off_t bytes) {
+    if (options.durability != DURABILITY_BATCH) {
+        close(dest_fd);
+        return;
+    }
+    // A full batch is taken out of the shared one and flushed without the
+    // lock, so other workers can keep finishing files meanwhile
+    struct sync_batch full;
+    full.count = 0;
+    pthread_mutex_lock(&sync_batch_lock);
+    if (__atomic_add_fetch(&sync_fds_open, 1, __ATOMIC_RELAXED) > sync_fds_limit) {
+        full.fds[0] = dest_fd;
+        full.count = 1;
+        full.bytes = bytes;
+        pthread_mutex_unlock(&sync_batch_lock);
+        durability_flush_batch(&full);
+        return;
+    }
+    sync_batch.fds[sync_batch.count++] = dest_fd;
+    sync_batch.bytes += bytes;
+    if (sync_batch.count >= options.sync_batch_files
+        || (unsigned long long)sync_batch.bytes >= options.sync_batch_bytes) {
+        memcpy(full.fds, sync_batch.fds, sync_batch.count * sizeof(int));
+        full.count = sync_batch.count;
+        full.bytes = sync_batch.bytes;
+        sync_batch.count = 0;
+        sync_batch.bytes = 0;
+    }
+    pthread_mutex_unlock(&sync_batch_lock);
+    durability_flush_batch(&full);
+}
+
+// Flush the current batch before it's full, when the process has run out of
+// descriptors. Returns how many files it held (0 if there was nothing to
+// free, so retrying won't help).
+int durability_flush_now() {
+    if (options.durability != DURABILITY_BATCH) {
+        return 0;
+    }
+    struct sync_batch full;
+    pthread_mutex_lock(&sync_batch_lock);
+    memcpy(full.fds, sync_batch.fds, sync_batch.count * sizeof(int));
+    full.count = sync_batch.count;
+    full.bytes = sync_batch.bytes;
+    sync_batch.count = 0;
+    sync_batch.bytes = 0;
+    pthread_mutex_unlock(&sync_batch_lock);
+    durability_flush_batch(&full);
+    return full.count;
+}
+
+// fdatasync() and close every file of a batch, and empty it
+void durability_flush_batch(struct sync_batch *batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < batch->count; i++) {
+        if (fdatasync(batch->fds[i]) != 0) {
+            perror(RED "Failed to flush destination file" RESET);
+            __atomic_fetch_add(&stats.sync_errors, 1, __ATOMIC_RELAXED);
+        }
+        close(batch->fds[i]);
+    }
+    __atomic_sub_fetch(&sync_fds_open, batch->count, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    __atomic_fetch_add(&stats.sync_batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.sync_micros,
+                       (end.tv_sec - start.tv_sec) * 1000000ULL + (end.tv_nsec - start.tv_nsec) / 1000, __ATOMIC_RELAXED);
+
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Flushed %d files (%lld bytes) to the target.\n" RESET, batch->count, (long long)batch->bytes);
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+// fsync() a directory so the entries created in it are on disk. Uses
+// `dir_fd` if it is open, otherwise opens `path`, which is also used in messages.
+void durability_sync_directory(int dir_fd, const char *path) {
+    int fd = dir_fd >= 0 ? dir_fd : open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0) {
+        perror(RED "Failed to flush directory" RESET);
+        random_delay();
+        fprintf(stderr, RED "   [ERROR] Could not flush directory: %s\n" RESET, path);
+        __atomic_fetch_add(&stats.sync_errors, 1, __ATOMIC_RELAXED);
+    }
+    if (fd >= 0 && fd != dir_fd) {
+        close(fd);
+    }
+}
+
+// Make the finished backup durable according to the durability option:
+// flush the last batch, or syncfs() the whole target filesystem, and then
+// fsync() the backup directory and the directory holding it
+void durability_finish(const char *backup_dir, const char *target_dir) {
+    if (options.durability == DURABILITY_NONE) {
+        return;
+    }
+    random_delay();
+    fprintf(stderr, GRAY "[DEBUG] Flushing the backup to the target (%s).\n" RESET, durability_names[options.durability]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (options.durability == DURABILITY_BATCH) {
+        durability_flush_batch(&sync_batch); // The workers are done, so no lock is needed
+    } else {
+        int dir_fd = open(backup_dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || syncfs(dir_fd) != 0) {
+            perror(RED "Failed to flush target filesystem" RESET);
+            __atomic_fetch_add(&stats.sync_errors, 1, __ATOMIC_RELAXED);
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+    durability_sync_directory(-1, backup_dir);
+    durability_sync_directory(-1, target_dir);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.flush_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Handle errors and exit
+void handle_error(const char *msg) {
+    perror(msg); // Print the error message
+    random_delay();
+    fprintf(stderr, RED "[FATAL] Program terminating due to error: %s\n" RESET, msg);
     exit(EXIT_FAILURE); // Exit the program
 }
 
+// Find the capability entry for a (source device, target device) pair, adding
+// an unprobed one if it's new. Returns NULL when the table is full, in which
+// case callers simply probe again for every file. Entries are never removed,
+// so the returned pointer stays valid without the lock; their fields are
+// read and updated atomically.
+struct dev_caps *get_dev_caps(dev_t src_dev, dev_t dest_dev) {
+    pthread_mutex_lock(&caps_lock);
+    for (int i = 0; i < dev_caps_count; i++) {
+        if (dev_caps_table[i].src_dev == src_dev && dev_caps_table[i].dest_dev == dest_dev) {
+            pthread_mutex_unlock(&caps_lock);
+            return &dev_caps_table[i];
+        }
+    }
+    if (dev_caps_count == MAX_DEV_CAPS) {
+        pthread_mutex_unlock(&caps_lock);
+        return NULL;
+    }
+
+    struct dev_caps *caps = &dev_caps_table[dev_caps_count++];
+    caps->src_dev = src_dev;
+    caps->dest_dev = dest_dev;
+    caps->reflink = -1;
+    caps->direct = -1;
+    caps->probed = 0;
+    caps->best = -1;
+    caps->unsupported = 0;
+    caps->from_config = 0;
+    pthread_mutex_unlock(&caps_lock);
+    return caps;
+}
+
+// Print what the run did beyond plain copying
+void print_backup_report() {
+    char size[32];
+    random_delay();
+    if (stats.sparse_files > 0) {
+        format_bytes(stats.sparse_hole_bytes, size, sizeof(size));
+        printf("Sparse files: %lu (%s of holes skipped)\n", stats.sparse_files, size);
+    }
+    if (stats.prealloc_honored > 0 || stats.prealloc_unsupported > 0) {
+        printf("Preallocation on %s: honored for %lu files, not available for %lu files\n",
+               fs_type_name(target_fs_type), stats.prealloc_honored, stats.prealloc_unsupported);
+    }
+    if (stats.small_files > 0) {
+        printf("Small files copied with one read and one write: %lu\n", stats.small_files);
+    }
+    if (stats.parallel_files > 0) {
+        printf("Copied in parallel ranges: %lu files\n", stats.parallel_files);
+    }
+    if (stats.shrunk_files > 0) {
+        printf(YELLOW "Files that shrank while being copied: %lu\n" RESET, stats.shrunk_files);
+    }
+    if (stats.direct_files > 0) {
+        format_bytes(stats.direct_bytes, size, sizeof(size));
+        printf("Copied with O_DIRECT: %lu files (%s)\n", stats.direct_files, size);
+    }
+    if (stats.page_cache_before_kib >= 0 && stats.page_cache_after_kib >= 0) {
+        char after[32];
+        format_bytes(stats.page_cache_before_kib * 1024, size, sizeof(size));
+        format_bytes(stats.page_cache_after_kib * 1024, after, sizeof(after));
+        printf("Page cache: %s before the backup, %s after\n", size, after);
+    }
+    if (stats.cache_dropped_bytes > 0) {
+        format_bytes(stats.cache_dropped_bytes, size, sizeof(size));
+        printf("Dropped from page cache: %s\n", size);
+    }
+    for (int i = 0; i < dev_caps_count; i++) {
+        struct dev_caps *caps = &dev_caps_table[i];
+        if (caps->probed && caps->best >= 0) {
+            printf("Copy strategy from device %u:%u to %u:%u: %s (%s)\n",
+                   major(caps->src_dev), minor(caps->src_dev), major(caps->dest_dev), minor(caps->dest_dev),
+                   strategy_names[caps->best + 1], caps->from_config ? "saved probe" : "probed this run");
+        }
+    }
+    if (stats.stream_files > 0) {
+        format_bytes(stats.stream_bytes, size, sizeof(size));
+        double seconds = stats.stream_seconds > 1e-9 ? stats.stream_seconds : 1e-9;
+        printf("Streamed %lu files (%s) with %s in %.2f s: %.1f MiB/s\n", stats.stream_files, size,
+               stream_method_names[stream_method], stats.stream_seconds, stats.stream_bytes / seconds / (1024 * 1024));
+    }
+    if (stats.writeback_waits > 0) {
+        printf("Smoothed writeback: waited %lu times for %.2f s in total\n", stats.writeback_waits, stats.writeback_wait_micros / 1e6);
+    }
+    if (options.write_latency) {
+        printf("Write latency:\n");
+        for (int i = 0; i < WRITE_LATENCY_BUCKETS; i++) {
+            if (stats.write_latency[i] == 0) {
+                continue;
+            }
+            unsigned long long low = i == 0 ? 0 : 1ULL << i, high = 2ULL << i; // Microseconds
+            printf("  %8llu - %8llu us: %lu\n", low, high, stats.write_latency[i]);
+        }
+    }
+    if (stats.sync_batches > 0) {
+        printf("Flushed while copying: %lu batches in %.2f s\n", stats.sync_batches, stats.sync_micros / 1e6);
+    }
+    if (options.durability != DURABILITY_NONE && !options.stream) {
+        printf("Final flush (%s): %.2f s\n", durability_names[options.durability], stats.flush_seconds);
+    }
+    if (stats.sync_errors > 0) {
+        printf(RED "Failed to flush: %lu files or directories\n" RESET, stats.sync_errors);
+    }
+    if (stats.btime_files > 0) {
+        printf("Creation times available for %lu files\n", stats.btime_files);
+    }
+    if (stats.mounts_crossed > 0) {
+        printf("Directories on another mount than their parent: %lu\n", stats.mounts_crossed);
+    }
+    if (stats.nospace_skipped > 0) {
+        printf("Skipped for lack of space on target: %lu files\n", stats.nospace_skipped);
+    }
+    if (stats.ordered_dirs > 0) {
+        printf("Entries sorted by %s in %lu directories", order_names[options.order], stats.ordered_dirs);
+        if (options.order == ORDER_EXTENT) {
+            printf(" (%lu files placed by their first extent)", stats.extent_files);
+        }
+        printf("\n");
+    }
+    if (stats.scheduled_files > 0) {
+        format_bytes(stats.scheduled_bytes, size, sizeof(size));
+        printf("Largest-first schedule: %lu files (%s) after a %.2f s pre-scan\n",
+               stats.scheduled_files, size, stats.prescan_micros / 1e6);
+    }
+    if (stats.skeleton_dirs > 0) {
+        printf("Skeleton: %lu directories created in %.2f s before copying\n", stats.skeleton_dirs, stats.skeleton_micros / 1e6);
+    }
+    if (stats.dir_metadata_errors > 0) {
+        printf(YELLOW "Directories without their source permissions or time: %lu\n" RESET, stats.dir_metadata_errors);
+    }
+    if (stats.walk_workers > 0) {
+        printf("Parallel traversal: %d workers, %lu tasks (%lu stolen) in %.2f s\n",
+               stats.walk_workers, stats.walk_tasks, stats.walk_steals, stats.walk_micros / 1e6);
+        double wall = stats.walk_micros > 0 ? stats.walk_micros : 1;
+        for (int i = 0; i < stats.walk_workers; i++) {
+            struct walk_worker_stats *worker = &walk_worker_stats[i];
+            format_bytes(worker->bytes, size, sizeof(size));
+            printf("  Worker %d: %lu files (%s), busy %.2f s (%.0f%%)\n", i, worker->files, size,
+                   worker->busy_micros / 1e6, 100 * worker->busy_micros / wall);
+        }
+    }
+}
+
+// Format a byte count with a binary unit, e.g. "512 B" or "1.5 GiB"
+void format_bytes(unsigned long long bytes, char *out, size_t out_size) {
+    static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0) {
+        snprintf(out, out_size, "%llu B", bytes);
+    } else {
+        snprintf(out, out_size, "%.1f %s", value, units[unit]);
+    }
+}
+
+// Map the statfs() magic numbers of common filesystems to their names
+const char *fs_type_name(long fs_type) {
+    switch ((unsigned long)fs_type) {
+    case 0xEF53: return "ext2/3/4";
+    case 0x58465342: return "xfs";
+    case 0x9123683E: return "btrfs";
+    case 0xF2F52010: return "f2fs";
+    case 0x2011BAB0: return "exfat";
+    case 0x4D44: return "vfat";
+    case 0x5346544E: return "ntfs";
+    case 0x65735546: return "fuse";
+    case 0x01021994: return "tmpfs";
+    case 0x6969: return "nfs";
+    case 0xFF534D42: return "cifs";
+    case 0x2FC12FC1: return "zfs";
+    default: return "unknown";
+    }
+}
+
+// Read the "Cached:" line of /proc/meminfo, in KiB. Returns -1 if unavailable.
+long long read_page_cache_kib() {
+    FILE *meminfo = fopen("/proc/meminfo", "r");
+    if (!meminfo) {
+        return -1;
+    }
+    char line[128];
+    long long cached = -1;
+    while (fgets(line, sizeof(line), meminfo) != NULL) {
+        if (sscanf(line, "Cached: %lld kB", &cached) == 1) {
+            break;
+        }
+    }
+    fclose(meminfo);
+    return cached;
+}
+
+// Restore a probe result saved by save_probe_results(), in the form
+// "SRC_MAJOR:SRC_MINOR,DEST_MAJOR:DEST_MINOR,BEST,UNSUPPORTED" where BEST is
+// a strategy name (or "none") and UNSUPPORTED lists strategy names joined by
+// '+' (or "none"). Returns 0 on success or -1 if the value is malformed.
+int load_probe_result(const char *value) {
+    unsigned src_major, src_minor, dest_major, dest_minor;
+    char best[32], unsupported[128];
+    if (sscanf(value, "%u:%u,%u:%u,%31[^,],%127s", &src_major, &src_minor, &dest_major, &dest_minor, best, unsupported) != 6) {
+        return -1;
+    }
+
+    int best_strategy = -1;
+    unsigned unsupported_mask = 0;
+    for (int strategy = 0; strategy < STRATEGY_COUNT; strategy++) {
+        const char *name = strategy_names[strategy + 1];
+        if (strcmp(best, name) == 0) {
+            best_strategy = strategy;
+        }
+        for (char *found = strstr(unsupported, name); found; found = strstr(found + 1, name)) {
+            size_t len = strlen(name);
+            if ((found == unsupported || found[-1] == '+') && (found[len] == '\0' || found[len] == '+')) {
+                unsupported_mask |= 1u << strategy;
+            }
+        }
+    }
+    if (best_strategy < 0 && strcmp(best, "none") != 0) {
+        return -1;
+    }
+
+    struct dev_caps *caps = get_dev_caps(makedev(src_major, src_minor), makedev(dest_major, dest_minor));
+    if (caps) {
+        caps->probed = 1;
+        caps->best = best_strategy;
+        caps->unsupported = unsupported_mask;
+        caps->from_config = 1;
+    }
+    return 0;
+}
+
+// Save the probe results of this run as "probe=" lines of the config file,
+// replacing older results for the same device pairs, so later runs can skip
+// probing. The config file is created with `default_dir` as its first line
+// if it doesn't exist yet.
+void save_probe_results(const char *default_dir) {
+    struct passwd *pw = getpwuid(getuid());
+    const char *homedir = pw->pw_dir;
+
+    char config_path[PATH_MAX];
+    snprintf(config_path, sizeof(config_path), CONFIG_FILE_PATH, homedir);
+
+    // Keep every line except the probe results being replaced
+    char *kept = NULL;
+    size_t kept_len = 0;
+    FILE *kept_lines = open_memstream(&kept, &kept_len);
+    if (!kept_lines) {
+        return;
+    }
+    FILE *old_config = fopen(config_path, "r");
+    char line[PATH_MAX];
+    int line_number = 0;
+    while (old_config && fgets(line, sizeof(line), old_config) != NULL) {
+        line_number++;
+        line[strcspn(line, "\n")] = 0;
+        unsigned src_major, src_minor, dest_major, dest_minor;
+        if (line_number > 1 && sscanf(line, "probe=%u:%u,%u:%u,", &src_major, &src_minor, &dest_major, &dest_minor) == 4) {
+            struct dev_caps *caps = get_dev_caps(makedev(src_major, src_minor), makedev(dest_major, dest_minor));
+            if (caps && caps->probed && !caps->from_config) {
+                continue; // Replaced below
+            }
+        }
+        fprintf(kept_lines, "%s\n", line);
+    }
+    if (old_config) {
+        fclose(old_config);
+    }
+    if (line_number == 0) {
+        fprintf(kept_lines, "%s\n", default_dir);
+    }
+
+    for (int i = 0; i < dev_caps_count; i++) {
+        struct dev_caps *caps = &dev_caps_table[i];
+        if (!caps->probed || caps->from_config) {
+            continue;
+        }
+        char unsupported[128] = "";
+        for (int strategy = 0; strategy < STRATEGY_COUNT; strategy++) {
+            if (caps->unsupported & (1u << strategy)) {
+                size_t len = strlen(unsupported);
+                snprintf(unsupported + len, sizeof(unsupported) - len, "%s%s", len ? "+" : "", strategy_names[strategy + 1]);
+            }
+        }
+        fprintf(kept_lines, "probe=%u:%u,%u:%u,%s,%s\n",
+                major(caps->src_dev), minor(caps->src_dev), major(caps->dest_dev), minor(caps->dest_dev),
+                caps->best >= 0 ? strategy_names[caps->best + 1] : "none", unsupported[0] ? unsupported : "none");
+    }
+    fclose(kept_lines);
+
+    ensure_config_dir_exists(config_path);
+    FILE *config_file = fopen(config_path, "w");
+    if (config_file) {
+        fputs(kept, config_file);
+        fclose(config_file);
+        random_delay();
+        fprintf(stderr, GRAY "[DEBUG] Saved copy strategy probe results to: %s\n" RESET, config_path);
+    } else {
+        perror(RED "Failed to save copy strategy probe results" RESET);
+    }
+    free(kept);
+}
+
 void random_delay() {
     // Seed the random number generator with the current time
     srand(time(NULL));